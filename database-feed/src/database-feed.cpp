@@ -1,8 +1,275 @@
 #include "database.h"
+#include "pagecodec.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <mutex>
+#include <queue>
 #include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Size of each read from the input file
+const size_t BLOCK_SIZE = 4 * 1024 * 1024;
+
+// Maximum amount of items waiting in each queue
+const size_t QUEUE_CAPACITY = 8;
+
+typedef std::chrono::steady_clock Clock;
+
+// A piece of the input file holding only complete lines
+struct Block
+{
+    std::vector<char> data;
+};
+
+// Rows parsed from a block, stored as fixed width,
+// NUL padded keys and values, and their hashes
+struct Batch
+{
+    std::vector<char> keys;
+    std::vector<char> values;
+    std::vector<unsigned> hashes;
+    unsigned numberOfRows;
+};
+
+// Time spent in each stage, in nanoseconds.
+// Parsing and hashing are summed over all parser threads.
+struct StageTimes
+{
+    std::atomic<long long> reading;
+    std::atomic<long long> parsing;
+    std::atomic<long long> hashing;
+    std::atomic<long long> inserting;
+};
+
+// Queue that blocks producers when full and consumers when empty.
+// Once closed, Pop returns false after the queue is drained.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity)
+        : m_capacity(capacity), m_closed(false)
+    { }
+
+    void Push(T item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notFull.wait(lock, [this] { return m_items.size() < m_capacity; });
+        m_items.push(std::move(item));
+        m_notEmpty.notify_one();
+    }
+
+    bool Pop(T& outItem)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_notEmpty.wait(lock, [this] { return !m_items.empty() || m_closed; });
+        if(m_items.empty()) return false;
+
+        outItem = std::move(m_items.front());
+        m_items.pop();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+    }
+
+private:
+    std::queue<T> m_items;
+    size_t m_capacity;
+    bool m_closed;
+    std::mutex m_mutex;
+    std::condition_variable m_notFull;
+    std::condition_variable m_notEmpty;
+};
+
+static long long ElapsedSince(const Clock::time_point& start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count();
+}
+
+// Reads the file in large blocks, cutting each block
+// at its last line break. The incomplete line is carried
+// to the beginning of the next block.
+static void ReadBlocks(
+    std::ifstream& file,
+    BoundedQueue<Block>& blocks,
+    StageTimes& times)
+{
+    std::vector<char> carry;
+    while(true)
+    {
+        Clock::time_point start = Clock::now();
+
+        Block block;
+        block.data.swap(carry);
+        size_t carrySize = block.data.size();
+        block.data.resize(carrySize + BLOCK_SIZE);
+        file.read(&block.data[carrySize], BLOCK_SIZE);
+        block.data.resize(carrySize + file.gcount());
+        bool endOfFile = !file;
+
+        if(!endOfFile)
+        {
+            // Find the last line break. If there is none,
+            // the line is bigger than a block, so keep reading.
+            size_t end = block.data.size();
+            while(end > 0 && block.data[end - 1] != '\n') end--;
+            if(end == 0)
+            {
+                carry.swap(block.data);
+                times.reading += ElapsedSince(start);
+                continue;
+            }
+
+            carry.assign(block.data.begin() + end, block.data.end());
+            block.data.resize(end);
+        }
+
+        times.reading += ElapsedSince(start);
+
+        if(!block.data.empty()) blocks.Push(std::move(block));
+        if(endOfFile) break;
+    }
+
+    blocks.Close();
+}
+
+// Copies at most size - 1 characters into a zeroed field
+static void CopyField(char* field, size_t size, const char* begin, const char* end)
+{
+    size_t length = std::min((size_t)(end - begin), size - 1);
+    memcpy(field, begin, length);
+}
+
+// Parses the lines of a block ("key,value") straight into
+// the fixed width fields of a batch. Lines without a comma,
+// or with an empty key, are skipped: an entry with an empty
+// key would be taken for an empty slot by the database.
+static void ParseBlock(const Block& block, Batch& batch, std::atomic<unsigned>& skipped)
+{
+    const char* data = block.data.data();
+    const char* end = data + block.data.size();
+
+    // Every line needs at least a line break and a comma
+    size_t maxRows = std::count(data, end, '\n') + 1;
+    batch.keys.assign(maxRows * Database::KEY_SIZE, '\0');
+    batch.values.assign(maxRows * Database::VALUE_SIZE, '\0');
+    batch.numberOfRows = 0;
+
+    while(data < end)
+    {
+        const char* lineEnd = (const char*)memchr(data, '\n', end - data);
+        if(lineEnd == nullptr) lineEnd = end;
+
+        const char* valueEnd = lineEnd;
+        if(valueEnd > data && valueEnd[-1] == '\r') valueEnd--;
+
+        const char* comma = (const char*)memchr(data, ',', valueEnd - data);
+        if(comma != nullptr && comma != data)
+        {
+            CopyField(
+                &batch.keys[batch.numberOfRows * Database::KEY_SIZE],
+                Database::KEY_SIZE, data, comma);
+            CopyField(
+                &batch.values[batch.numberOfRows * Database::VALUE_SIZE],
+                Database::VALUE_SIZE, comma + 1, valueEnd);
+            batch.numberOfRows++;
+        }
+        else if(valueEnd > data) skipped++;
+
+        data = lineEnd + 1;
+    }
+}
+
+static void ParseBlocks(
+    const Database& db,
+    BoundedQueue<Block>& blocks,
+    BoundedQueue<Batch>& batches,
+    StageTimes& times,
+    std::atomic<unsigned>& skipped)
+{
+    Block block;
+    while(blocks.Pop(block))
+    {
+        Clock::time_point start = Clock::now();
+        Batch batch;
+        ParseBlock(block, batch, skipped);
+        times.parsing += ElapsedSince(start);
+
+        // Hashing doesn't depend on the state of the table,
+        // so it can be done here, away from the inserting thread
+        start = Clock::now();
+        batch.hashes.resize(batch.numberOfRows);
+        db.CalcKeyHashes(batch.keys.data(), batch.numberOfRows, batch.hashes.data());
+        times.hashing += ElapsedSince(start);
+
+        batches.Push(std::move(batch));
+    }
+}
+
+// Inserts the rows of each batch grouped by index,
+// so consecutive insertions touch the same pages
+static unsigned long long InsertBatches(
+    Database& db,
+    BoundedQueue<Batch>& batches,
+    StageTimes& times)
+{
+    unsigned long long numberOfRows = 0;
+    std::vector< std::pair<unsigned, unsigned> > order;
+
+    Batch batch;
+    while(batches.Pop(batch))
+    {
+        Clock::time_point start = Clock::now();
+
+        order.resize(batch.numberOfRows);
+        for(unsigned i = 0; i < batch.numberOfRows; i++)
+        {
+            order[i] = std::make_pair(db.CalcIndex(batch.hashes[i]), i);
+        }
+        std::sort(order.begin(), order.end());
+
+        for(unsigned i = 0; i < batch.numberOfRows; i++)
+        {
+            unsigned row = order[i].second;
+            db.InsertHashedEntry(
+                batch.hashes[row],
+                &batch.keys[row * Database::KEY_SIZE],
+                &batch.values[row * Database::VALUE_SIZE]);
+        }
+
+        numberOfRows += batch.numberOfRows;
+        times.inserting += ElapsedSince(start);
+    }
+
+    return numberOfRows;
+}
+
+static void PrintUsage(const char* programName)
+{
+    std::cerr << "Usage: " << programName << " <file> [parser threads] [-c]" << std::endl;
+}
+
+static bool IsNumber(const std::string& text)
+{
+    return !text.empty() &&
+        text.size() <= 9 &&
+        text.find_first_not_of("0123456789") == std::string::npos;
+}
 
 int main(int argc, char* args[])
 {
@@ -11,36 +278,109 @@ int main(int argc, char* args[])
     if(argc < 2)
     {
         cerr << "Error: Missing file name." << endl;
+        PrintUsage(args[0]);
         return 0;
     }
 
+    // By default, one core is left to the reading and inserting threads
+    // -c creates the database with compressed pages
+    unsigned numberOfParsers = 0;
+    bool compressedPages = false;
+    for(int i = 2; i < argc; i++)
+    {
+        string argument = args[i];
+        if(argument == "-c") compressedPages = true;
+        else if(IsNumber(argument)) numberOfParsers = stoul(argument);
+        else
+        {
+            cerr << "Error: Invalid argument: " << argument << endl;
+            PrintUsage(args[0]);
+            return 0;
+        }
+    }
+
     ifstream file;
-    file.open(args[1]);
+    file.open(args[1], ios::binary);
 
     if(!file.is_open())
     {
-        cerr << "Error: Unable to open file: " << args[1] << std::endl; 
+        cerr << "Error: Unable to open file: " << args[1] << std::endl;
         return 0;
     }
 
-    Database* db = new Database();
-    std::string line;
-    while(getline(file, line))
+    if(numberOfParsers == 0)
     {
-        
-        size_t commaPos = line.find(',');
-        string key = line.substr(0, commaPos);
-        if(key == "ssec")
-        {
-            int a;
-            cout << a << endl;
-        }
-        string value = line.substr(commaPos + 1, line.size() - commaPos - 1);
-        db->InsertEntry(key.c_str(), value.c_str());
+        unsigned cores = thread::hardware_concurrency();
+        numberOfParsers = cores > 1 ? cores - 1 : 1;
+    }
+
+    Database* db = new Database(HashFunction::FNV1A, false, compressedPages);
+    if(!db->IsOpen())
+    {
+        cerr << "Error: Unable to open the data file, or its format is unknown." << endl;
+        delete db;
+        return 0;
+    }
+
+    StageTimes times;
+    times.reading = 0;
+    times.parsing = 0;
+    times.hashing = 0;
+    times.inserting = 0;
+    atomic<unsigned> skipped(0);
+
+    BoundedQueue<Block> blocks(QUEUE_CAPACITY);
+    BoundedQueue<Batch> batches(QUEUE_CAPACITY);
+
+    Clock::time_point start = Clock::now();
+
+    thread reader(ReadBlocks, ref(file), ref(blocks), ref(times));
+
+    vector<thread> parsers;
+    for(unsigned i = 0; i < numberOfParsers; i++)
+    {
+        parsers.push_back(thread(
+            ParseBlocks, cref(*db), ref(blocks), ref(batches),
+            ref(times), ref(skipped)));
+    }
+
+    // The batches queue is closed once every parser is done
+    thread closer([&parsers, &batches]
+    {
+        for(unsigned i = 0; i < parsers.size(); i++) parsers[i].join();
+        batches.Close();
+    });
+
+    unsigned long long numberOfRows = InsertBatches(*db, batches, times);
+
+    reader.join();
+    closer.join();
+
+    double seconds = ElapsedSince(start) / 1e9;
+
+    cout << "Rows inserted: " << numberOfRows << endl;
+    if(skipped > 0) cout << "Lines skipped: " << skipped << endl;
+    cout << "Total time: " << seconds << " s" << endl;
+    cout << "Rows/s: " << (seconds > 0 ? numberOfRows / seconds : 0) << endl;
+    cout << "Reading: " << times.reading / 1e9 << " s" << endl;
+    cout << "Parsing: " << times.parsing / 1e9 << " s ("
+         << numberOfParsers << " threads)" << endl;
+    cout << "Hashing: " << times.hashing / 1e9 << " s ("
+         << numberOfParsers << " threads)" << endl;
+    cout << "Inserting: " << times.inserting / 1e9 << " s" << endl;
+
+    if(db->HasCompressedPages())
+    {
+        PageCodecStats stats = db->GetPageCodecStats();
+        cout << "Compression ratio: " << stats.GetCompressionRatio() << endl;
+        cout << "Pages encoded: " << stats.pagesEncoded << " ("
+             << stats.GetEncodeNanosecondsPerPage() << " ns/page)" << endl;
+        cout << "Pages decoded: " << stats.pagesDecoded << " ("
+             << stats.GetDecodeNanosecondsPerPage() << " ns/page)" << endl;
     }
 
     delete db;
     db = nullptr;
 
     return 0;
-}
\ No newline at end of file
+}
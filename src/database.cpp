@@ -1,8 +1,90 @@
 #include "database.h"
-#include <iostream>
+#include "onlinesnapshot.h"
+#include "pagecodec.h"
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+struct RedistributionContext
+{
+    // Next index to be split, and the end of the range
+    std::atomic<unsigned> nextIndex;
+    unsigned last;
+
+    // Number of indices once the whole range is split
+    unsigned numberOfIndices;
+
+    // Protects the fields below
+    std::mutex mutex;
+    unsigned maxExtension;
+    unsigned addedPages;
+};
+
+// Amount of indices a worker takes from the range at a time
+static const unsigned SPLIT_BATCH_SIZE = 64;
 
-Database::Database()
+// Makes sure the file has at least size bytes.
+// If create is true, the file is created (or truncated) first.
+static void GrowFile(const std::string& fileName, unsigned size, bool create)
+{
+    std::fstream file;
+    if(create)
+    {
+        file.open(fileName, std::fstream::out | std::fstream::binary);
+    }
+    else
+    {
+        file.open(fileName, 
+            std::fstream::in    | 
+            std::fstream::out   | 
+            std::fstream::binary);
+    }
+
+    file.seekp(0, std::ios::end);
+    if((unsigned)file.tellp() < size)
+    {
+        file.seekp(size - 1);
+        file.write("", 1);
+    }
+}
+
+// Identifies the main data file, and the version of its layout.
+// Each version appends fields to the Header of the one before:
+// 1 has hashFunction, 2 adds uniqueKeys, 3 adds reservedIndices,
+// and 4 adds compressedPages and compressionRatio.
+static const char DATABASE_MAGIC[8] = { 'S', 'K', 'Y', 'D', 'B', 'D', 'A', 'T' };
+static const unsigned DATABASE_VERSION = 4;
+
+// Returns the size of the Header of a main data file of the
+// given version, which holds only the fields it knows about
+static unsigned HeaderSize(unsigned version)
+{
+    if(version == 1) return offsetof(Header, uniqueKeys);
+    if(version == 2) return offsetof(Header, reservedIndices);
+    if(version == 3) return offsetof(Header, compressedPages);
+    return sizeof(Header);
+}
+
+Database::Database(HashFunction hashFunction, bool uniqueKeys, bool compressedPages)
+    : m_hashFunction(hashFunction),
+    m_uniqueKeys(uniqueKeys),
+    m_compressedPages(compressedPages),
+    m_compressionRatio(1.0f),
+    m_level(0),
+    m_next(0),
+    m_numberOfEntries(0),
+    m_numberOfIndices(0),
+    m_numberOfPages(0),
+    m_currentMaxExtension(0),
+    m_version(DATABASE_VERSION),
+    m_headerSize(sizeof(Header)),
+    m_pageCodec(new PageCodec(INDEX_SIZE))
 {
     // Checks if header file exists.
     // If not, create it.
@@ -12,14 +94,62 @@ Database::Database()
     }
 
     // Read header data
-    Header header = { 0, 0, 0, 0 , 0, 0 };
-    m_mainDataFile.read((char*)&header, HEADER_SIZE);
-    m_level = header.level;
-    m_numberOfEntries = header.numberOfEntries;
-    m_numberOfPages = header.numberOfPages;
-    m_numberOfIndices = header.numberOfIndices;
-    m_next = header.next;
-    m_currentMaxExtension = header.currentMaxExtension;
+    Header header;
+    memset(&header, 0, sizeof(Header));
+    m_mainDataFile.read((char*)&header, sizeof(Header));
+
+    if(memcmp(header.magic, DATABASE_MAGIC, sizeof(header.magic)) == 0)
+    {
+        if(header.version == 0 || header.version > DATABASE_VERSION ||
+           header.hashFunction > (unsigned)HashFunction::WY64)
+        {
+            m_mainDataFile.close();
+            return;
+        }
+
+        // Fields added after the version of the file keep their defaults
+        m_version = header.version;
+        m_headerSize = HeaderSize(m_version);
+        memset((char*)&header + m_headerSize, 0, sizeof(Header) - m_headerSize);
+
+        m_level = header.level;
+        m_numberOfEntries = header.numberOfEntries;
+        m_numberOfPages = header.numberOfPages;
+        m_numberOfIndices = header.numberOfIndices;
+        m_next = header.next;
+        m_currentMaxExtension = header.currentMaxExtension;
+        m_hashFunction = (HashFunction)header.hashFunction;
+        m_uniqueKeys = header.uniqueKeys != 0;
+        m_compressedPages = header.compressedPages != 0;
+        m_compressionRatio = std::max(1.0f, header.compressionRatio / 1000.0f);
+    }
+    else
+    {
+        // Files without a magic start with N, which never changes
+        LegacyHeader legacyHeader;
+        memcpy(&legacyHeader, &header, sizeof(LegacyHeader));
+        if(legacyHeader.N != N)
+        {
+            m_mainDataFile.close();
+            return;
+        }
+
+        m_version = 0;
+        m_headerSize = sizeof(LegacyHeader);
+        m_level = legacyHeader.level;
+        m_numberOfEntries = legacyHeader.numberOfEntries;
+        m_numberOfPages = legacyHeader.numberOfPages;
+        m_numberOfIndices = legacyHeader.numberOfIndices;
+        m_next = legacyHeader.next;
+        m_currentMaxExtension = legacyHeader.currentMaxExtension;
+        m_hashFunction = HashFunction::FNV1A;
+        m_uniqueKeys = false;
+        m_compressedPages = false;
+    }
+
+    // The header may have been cut short
+    m_mainDataFile.clear();
+    UpdateLevelSize();
 }
 
 Database::~Database()
@@ -27,7 +157,43 @@ Database::~Database()
 
 int Database::InsertEntry(const char key[21], const char value[51])
 {
-    unsigned hash = CalcHash(key);
+    return InsertHashedEntry(CalcKeyHash(key), key, value);
+}
+
+int Database::InsertHashedEntry(unsigned keyHash, const char key[21], const char value[51])
+{
+    // There can't be two entries with the same key
+    if(m_uniqueKeys) return UpsertEntryAtIndex(CalcIndex(keyHash), key, value);
+
+    return InsertEntryAtIndex(CalcIndex(keyHash), key, value);
+}
+
+// Copies key and value into a record, padding them with 0's
+static Record MakeRecord(const char key[21], const char value[51])
+{
+    Record record;
+    strncpy(record.key, key, sizeof(record.key));
+    strncpy(record.value, value, sizeof(record.value));
+    return record;
+}
+
+int Database::InsertEntryAtIndex(unsigned hash, const char key[21], const char value[51])
+{
+    if(m_compressedPages)
+    {
+        IndexHeader ih;
+        std::vector<Record> records;
+        unsigned pagesInUse = ReadCompressedIndex(hash, ih, records);
+        records.push_back(MakeRecord(key, value));
+        WriteCompressedIndex(hash, ih, records, pagesInUse);
+
+        m_numberOfEntries++;
+        UpdateMainHeader();
+
+        SplitIfNeeded();
+        return 0;
+    }
+
     unsigned indexOffset = CalcIndexOffset(hash);
 
     m_mainDataFile.seekp(indexOffset, std::ios::beg);
@@ -39,18 +205,35 @@ int Database::InsertEntry(const char key[21], const char value[51])
     // Otherwise, just write at the first slot.
     if(ih.numberOfEntries != 0)
     {
-        // Check if entry is full
+        // If the index is full, the first empty slot
+        // is the first one of a new extension
         if(ih.numberOfEntries == (ih.numberOfExtensions + 1) * ENTRIES_PER_PAGE)
         {
-            ExtendIndex(hash);
-            // Update index header value
-            ih.numberOfExtensions++;
+            firstEmptyPos = ih.numberOfEntries;
         }
+        else firstEmptyPos = FindFirstEmptySlot(hash);
+    }
 
-        firstEmptyPos = FindFirstEmptySlot(hash);
+    InsertEntryAtSlot(hash, ih, firstEmptyPos, key, value);
+    return 0;
+}
+
+void Database::InsertEntryAtSlot(
+    unsigned index,
+    IndexHeader& ih,
+    unsigned position,
+    const char key[21],
+    const char value[51])
+{
+    // The slot is right past the last page of the index
+    if(position == (ih.numberOfExtensions + 1) * ENTRIES_PER_PAGE)
+    {
+        ExtendIndex(index);
+        // Update index header value
+        ih.numberOfExtensions++;
     }
 
-    WriteEntry(hash, firstEmptyPos, key, value);
+    WriteEntry(index, position, key, value);
     
     // Update database header (only in memory)
     // The final value is stored only when the program is closed
@@ -59,25 +242,35 @@ int Database::InsertEntry(const char key[21], const char value[51])
     // Update index header
     ih.numberOfEntries++;
     
-    UpdateIndexHeader(hash, ih);
+    UpdateIndexHeader(index, ih);
     UpdateMainHeader();
 
+    SplitIfNeeded();
+}
+
+void Database::SplitIfNeeded()
+{
     // Test if max limit has been exceeded
     float load = CalcLoad();
     if(load > MAX_LIMIT)
     {
         SplitPage(m_next);
     }
+}
 
-    return 0;
+PageCodecStats Database::GetPageCodecStats() const
+{
+    return m_pageCodec->GetStats();
 }
 
 int Database::GetEntry(const char key[21], std::vector<std::string>& outValues)
 {
     bool anyEntryFound = false;
     std::fstream* dataFile = &m_mainDataFile;
-    unsigned index_offset = CalcIndexOffsetFromKey(key);
     unsigned hash = CalcHash(key);
+    unsigned index_offset = CalcIndexOffset(hash);
+
+    if(m_compressedPages) return GetCompressedEntry(hash, key, outValues);
 
     dataFile->seekg(index_offset);
     IndexHeader ih;
@@ -100,6 +293,9 @@ int Database::GetEntry(const char key[21], std::vector<std::string>& outValues)
                 outValues.push_back(e.value);
                 anyEntryFound = true;
                 // strcpy(outValue, e.value);
+
+                // There can't be any other entry with the same key
+                if(m_uniqueKeys) break;
             }
             entryNumber++;
             // All entries have been verified
@@ -123,6 +319,15 @@ int Database::DeleteEntry(const char key[21])
     std::fstream* dataFile = &m_mainDataFile;
     unsigned hash = CalcHash(key);
 
+    if(m_compressedPages)
+    {
+        if(DeleteCompressedEntry(hash, key) == 0) return 0;
+
+        UpdateMainHeader();
+        MergeIfNeeded();
+        return 1;
+    }
+
     IndexHeader ih;
     dataFile->seekg(CalcIndexOffset(hash));
     dataFile->read((char *)&ih, INDEX_HEADER_SIZE);
@@ -140,6 +345,8 @@ int Database::DeleteEntry(const char key[21])
         {
             if(strcmp(key, e.key) == 0)
             {
+                PreservePage(index / ENTRIES_PER_PAGE, hash);
+
                 // Move file pointer to the beggining of entry
                 dataFile->seekp((unsigned)dataFile->tellp() - ENTRY_SIZE);
                 dataFile->write("\0", 1);
@@ -149,6 +356,9 @@ int Database::DeleteEntry(const char key[21])
                 // Update main and index headers
                 ih.numberOfEntries--;
                 m_numberOfEntries--;
+
+                // There can't be any other entry with the same key
+                if(m_uniqueKeys) break;
             }
 
             // Entry found
@@ -168,6 +378,15 @@ int Database::DeleteEntry(const char key[21])
     UpdateIndexHeader(hash, ih);
     UpdateMainHeader();
 
+    MergeIfNeeded();
+
+    // Checks if at least one entry was deleted
+    if(ih.numberOfEntries < numberOfEntries) return 1;
+    return 0;
+}
+
+void Database::MergeIfNeeded()
+{
     if(m_numberOfIndices > N) 
     {
         float load = CalcLoad();
@@ -180,11 +399,131 @@ int Database::DeleteEntry(const char key[21])
             }
         }
     }
-    // Checks if at least one entry was deleted
-    if(ih.numberOfEntries < numberOfEntries) return 1;
+}
+
+int Database::UpsertEntry(const char key[21], const char value[51])
+{
+    return UpsertEntryAtIndex(CalcHash(key), key, value);
+}
+
+int Database::UpsertEntryAtIndex(unsigned hash, const char key[21], const char value[51])
+{
+    IndexHeader ih;
+
+    if(m_compressedPages)
+    {
+        std::vector<Record> records;
+        unsigned pagesInUse = ReadCompressedIndex(hash, ih, records);
+
+        int updated = 0;
+        for(unsigned i = 0; i < records.size() && !updated; i++)
+        {
+            if(strncmp(records[i].key, key, KEY_SIZE) != 0) continue;
+
+            strncpy(records[i].value, value, VALUE_SIZE);
+            updated = 1;
+        }
+        if(!updated) records.push_back(MakeRecord(key, value));
+
+        // The index is rewritten either way, so the
+        // new entry is added without reading it again
+        WriteCompressedIndex(hash, ih, records, pagesInUse);
+        if(updated) return 1;
+
+        m_numberOfEntries++;
+        UpdateMainHeader();
+
+        SplitIfNeeded();
+        return 0;
+    }
+
+    unsigned position = 0;
+    if(FindEntry(hash, key, ih, position))
+    {
+        // The key is kept, so the entry can be overwritten
+        // without changing any header
+        WriteEntry(hash, position, key, value);
+        return 1;
+    }
+
+    // FindEntry went through the whole index, and
+    // stored its first empty slot into position
+    InsertEntryAtSlot(hash, ih, position, key, value);
     return 0;
 }
 
+void Database::ForEachIndex(const std::function<void(std::vector<Record>&)>& callback)
+{
+    std::vector<char> page(INDEX_SIZE);
+    std::vector<Record> records;
+    for(unsigned index = 0; index < m_numberOfIndices; index++)
+    {
+        IndexHeader ih;
+        m_mainDataFile.seekg(CalcIndexOffset(index));
+        m_mainDataFile.read((char *)&ih, INDEX_HEADER_SIZE);
+        if(ih.numberOfEntries == 0) continue;
+
+        records.clear();
+        for(unsigned extension = 0; 
+            extension <= ih.numberOfExtensions && records.size() < ih.numberOfEntries;
+            extension++)
+        {
+            if(extension == 0)
+            {
+                m_mainDataFile.read(&page[0], INDEX_SIZE);
+            }
+            else
+            {
+                std::fstream* dataFile = GetExtensionFile(extension);
+                dataFile->seekg(CalcIndexOffset(index, false));
+                dataFile->read(&page[0], INDEX_SIZE);
+            }
+
+            if(m_compressedPages)
+            {
+                m_pageCodec->DecodePage(&page[0], records);
+                continue;
+            }
+
+            for(unsigned i = 0; i < ENTRIES_PER_PAGE; i++)
+            {
+                const Entry* e = (const Entry*)&page[i * ENTRY_SIZE];
+                if(IsEntryEmpty(e)) continue;
+
+                records.push_back(MakeRecord(e->key, e->value));
+            }
+        }
+
+        callback(records);
+    }
+}
+
+void Database::Reserve(unsigned numberOfIndices, unsigned numberOfThreads)
+{
+    if(numberOfThreads == 0) numberOfThreads = std::thread::hardware_concurrency();
+    if(numberOfThreads == 0) numberOfThreads = 1;
+
+    // The workers use their own file streams, so everything
+    // buffered here must reach the files, and nothing read
+    // before the split can be reused after it
+    m_mainDataFile.close();
+    m_indexExtensionsDataFiles.clear();
+
+    while(m_numberOfIndices < numberOfIndices)
+    {
+        // A round of splits can't go past the end of the current level,
+        // since indices of the next level depend on the ones being created
+        unsigned last = std::min(
+            m_levelSize, 
+            m_next + (numberOfIndices - m_numberOfIndices));
+
+        SplitRange(m_next, last, numberOfThreads);
+    }
+
+    OpenMainDataFile();
+    UpdateMainHeader();
+}
+
 bool Database::OpenMainDataFile()
 {
     m_mainDataFile.open(DATA_FILE_NAME_PREFIX + DATA_FILE_NAME_EXTENSION,
@@ -204,12 +543,16 @@ void Database::CreateMainDataFile()
 
     m_level = 0;
     m_next = 0;
-    Header h = { N, m_level, N, 0, N, m_next, 0 };
+    m_numberOfPages = N;
+    m_numberOfEntries = 0;
+    m_numberOfIndices = N;
+    m_currentMaxExtension = 0;
+    Header h = MakeHeader();
     m_mainDataFile.write((const char*)&h, sizeof(Header));
 
     // Fill file with empty data
     m_mainDataFile.seekp(
-        N * MAIN_INDEX_SIZE + HEADER_SIZE - 1);
+        N * MAIN_INDEX_SIZE + sizeof(Header) - 1);
     m_mainDataFile.write("", 1);
     m_mainDataFile.close();
 
@@ -218,27 +561,133 @@ void Database::CreateMainDataFile()
 
 void Database::UpdateMainHeader()
 {
-    // Stores header data to file
-    Header h = { 
-        N, 
-        m_level, 
-        m_numberOfPages, 
-        m_numberOfEntries, 
-        m_numberOfIndices, 
-        m_next,
-        m_currentMaxExtension
-    };
+    // Stores header data to file.
+    // Snapshots keep their own copy of the header,
+    // so there is nothing to preserve here.
     m_mainDataFile.seekp(std::ios::beg);
-    m_mainDataFile.write((const char*)&h, sizeof(Header));
+    if(m_version == 0)
+    {
+        LegacyHeader h = { 
+            N, 
+            m_level, 
+            m_numberOfPages, 
+            m_numberOfEntries, 
+            m_numberOfIndices, 
+            m_next,
+            m_currentMaxExtension
+        };
+        m_mainDataFile.write((const char*)&h, sizeof(LegacyHeader));
+        return;
+    }
+
+    // Files of older versions keep their layout
+    Header h = MakeHeader();
+    h.version = m_version;
+    m_mainDataFile.write((const char*)&h, m_headerSize);
+}
+
+Header Database::MakeHeader() const
+{
+    Header h;
+    memcpy(h.magic, DATABASE_MAGIC, sizeof(h.magic));
+    h.version = DATABASE_VERSION;
+    h.N = N;
+    h.level = m_level;
+    h.numberOfPages = m_numberOfPages;
+    h.numberOfEntries = m_numberOfEntries;
+    h.numberOfIndices = m_numberOfIndices;
+    h.next = m_next;
+    h.currentMaxExtension = m_currentMaxExtension;
+    h.hashFunction = (unsigned)m_hashFunction;
+    h.uniqueKeys = m_uniqueKeys ? 1u : 0u;
+    h.reservedIndices = 0;
+    h.compressedPages = m_compressedPages ? 1u : 0u;
+    h.compressionRatio = (unsigned)(m_compressionRatio * 1000);
+    return h;
+}
+
+std::unique_ptr<OnlineSnapshot> Database::CreateSnapshot()
+{
+    if(m_snapshotState && !m_snapshotState->released) return nullptr;
+
+    // Pages not changed after this point are read straight
+    // from the files, so nothing can be left in the buffers
+    m_mainDataFile.flush();
+    for(auto ep = m_indexExtensionsDataFiles.begin();
+        ep != m_indexExtensionsDataFiles.end();
+        ep++)
+    {
+        ep->second.flush();
+    }
+
+    m_snapshotState = std::make_shared<SnapshotState>(
+        MakeHeader(),
+        DATA_FILE_NAME_PREFIX,
+        DATA_FILE_NAME_EXTENSION,
+        m_headerSize,
+        MAIN_INDEX_SIZE,
+        INDEX_SIZE);
+
+    return std::unique_ptr<OnlineSnapshot>(new OnlineSnapshot(m_snapshotState));
+}
+
+void Database::PreservePage(unsigned extensionNumber, unsigned index)
+{
+    if(m_snapshotState) m_snapshotState->Preserve(extensionNumber, index);
 }
 
 void Database::UpdateIndexHeader(unsigned index, const IndexHeader& ih)
 {
+    PreservePage(0, index);
     m_mainDataFile.seekp(CalcIndexOffset(index));
     m_mainDataFile.write((const char*)&ih, INDEX_HEADER_SIZE);
 }
 
 unsigned Database::CalcHash(const char key[21])
+{
+    return CalcIndex(CalcKeyHash(key));
+}
+
+unsigned Database::CalcKeyHash(const char key[21]) const
+{
+    if(m_hashFunction == HashFunction::WY64) return HashWY64(key);
+    return HashFNV1a(key);
+}
+
+void Database::CalcKeyHashes(const char* keys, unsigned count, unsigned* outHashes) const
+{
+    // The hash function is chosen once for the whole batch,
+    // and each key is independent from the others, so the
+    // loop body can be overlapped by the processor
+    if(m_hashFunction == HashFunction::WY64)
+    {
+        for(unsigned i = 0; i < count; i++)
+        {
+            outHashes[i] = HashWY64(keys + i * KEY_SIZE);
+        }
+    }
+    else
+    {
+        for(unsigned i = 0; i < count; i++)
+        {
+            outHashes[i] = HashFNV1a(keys + i * KEY_SIZE);
+        }
+    }
+}
+
+unsigned Database::CalcIndex(unsigned keyHash) const
+{
+    // keyHash % (2 * levelSize) is either keyHash % levelSize or
+    // keyHash % levelSize + levelSize, depending on the parity of
+    // keyHash / levelSize. This way a single division is enough
+    // to find the index, even for pages that were already split.
+    unsigned quotient = keyHash / m_levelSize;
+    unsigned hash = keyHash - quotient * m_levelSize;
+    if(hash < m_next && (quotient & 1)) hash += m_levelSize;
+    return hash;
+}
+
+unsigned Database::HashFNV1a(const char key[21]) const
 {
     int i = 0;
     unsigned fnvprime = 16777619;
@@ -251,9 +700,46 @@ unsigned Database::CalcHash(const char key[21])
         i++;
     }
 
-    unsigned hash = initialhash % (N * TwoToThePower(m_level));
-    if(hash < m_next) return initialhash % (N * TwoToThePower(m_level + 1));
-    return hash;
+    return initialhash;
+}
+
+// 64x64 -> 128 bit multiplication, folded back to 64 bits
+// by xoring the high and low halves (wyhash's "mum").
+// Written with 32 bit halves to stay within standard C++.
+static inline uint64_t MultiplyMix(uint64_t a, uint64_t b)
+{
+    uint64_t ha = a >> 32, hb = b >> 32;
+    uint64_t la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32);
+    uint64_t carry = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    carry += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+    return lo ^ hi;
+}
+
+unsigned Database::HashWY64(const char key[21]) const
+{
+    const uint64_t secret0 = 0xa0761d6478bd642full;
+    const uint64_t secret1 = 0xe7037ed1a0b428dbull;
+    const uint64_t secret2 = 0x8ebc6af09c88c6e3ull;
+
+    // Only the key itself is copied into a zeroed buffer,
+    // which is then consumed 8 bytes at a time
+    size_t length = FieldLength(key, KEY_SIZE);
+
+    uint64_t words[3] = { 0, 0, 0 };
+    memcpy(words, key, length);
+
+    uint64_t hash = MultiplyMix(words[0] ^ secret1, words[1] ^ secret0 ^ length);
+    hash = MultiplyMix(hash ^ words[2] ^ secret2, length ^ secret1);
+    return (unsigned)(hash ^ (hash >> 32));
+}
+
+void Database::UpdateLevelSize()
+{
+    m_levelSize = N * TwoToThePower(m_level);
 }
 
 unsigned Database::TwoToThePower(int exponent)
@@ -264,7 +750,7 @@ unsigned Database::TwoToThePower(int exponent)
 
 unsigned Database::CalcIndexOffset(int index, bool isMainFile)
 {
-    return (isMainFile ? HEADER_SIZE : 0) + index * ((isMainFile ? INDEX_HEADER_SIZE : 0) + INDEX_SIZE);
+    return (isMainFile ? m_headerSize : 0) + index * ((isMainFile ? INDEX_HEADER_SIZE : 0) + INDEX_SIZE);
 }
 
 unsigned Database::CalcIndexOffsetFromKey(const char key[21])
@@ -297,11 +783,58 @@ unsigned Database::FindFirstEmptySlot(unsigned index)
     return -1;
 }
 
+bool Database::FindEntry(
+    unsigned index,
+    const char key[21],
+    IndexHeader& outIh,
+    unsigned& outPosition)
+{
+    std::fstream* dataFile = &m_mainDataFile;
+
+    dataFile->seekg(CalcIndexOffset(index));
+    dataFile->read((char *)&outIh, INDEX_HEADER_SIZE);
+
+    unsigned position = 0;
+    bool emptySlotFound = false;
+    for(unsigned i = 0; i < outIh.numberOfEntries;)
+    {
+        Entry e = { 0, 0 };
+        dataFile->read((char *)&e, ENTRY_SIZE);
+
+        if(!IsEntryEmpty(&e))
+        {
+            if(strcmp(e.key, key) == 0)
+            {
+                outPosition = position;
+                return true;
+            }
+            i++;
+        }
+        else if(!emptySlotFound)
+        {
+            outPosition = position;
+            emptySlotFound = true;
+        }
+
+        position++;
+        if(position % ENTRIES_PER_PAGE == 0 && i < outIh.numberOfEntries)
+        {
+            dataFile = GetExtensionFile(position / ENTRIES_PER_PAGE);
+            dataFile->seekg(CalcIndexOffset(index, false));
+        }
+    }
+
+    // Every slot after the last entry is empty
+    if(!emptySlotFound) outPosition = position;
+    return false;
+}
+
 void Database::WriteEntryAtPosition(
         const char key[21], 
         const char value[51], 
         const std::streampos& pos)
 {
+    PreservePage(0, ((unsigned)pos - m_headerSize) / MAIN_INDEX_SIZE);
     m_mainDataFile.seekp(pos);
     m_mainDataFile.write((const char*)key, 21);
     m_mainDataFile.write((const char*)value, 51);
@@ -327,6 +860,7 @@ void Database::WriteEntry(
         offset = CalcIndexOffset(index, false);
     }
 
+    PreservePage(extensionNumber, index);
     file->seekp(offset + (position % ENTRIES_PER_PAGE) * ENTRY_SIZE);
     file->write(key, 21);
     file->write(value, 51);
@@ -339,7 +873,12 @@ bool Database::IsEntryEmpty(const Entry* entry)
 
 float Database::CalcLoad()
 {
-    return m_numberOfEntries / ((float)m_numberOfPages * ENTRIES_PER_PAGE);
+    // Compressed pages hold more entries, otherwise the table
+    // would be split until they are mostly empty
+    float entriesPerPage = ENTRIES_PER_PAGE;
+    if(m_compressedPages) entriesPerPage *= m_compressionRatio;
+
+    return m_numberOfEntries / ((float)m_numberOfPages * entriesPerPage);
 }
 
 void Database::SplitPage(unsigned page)
@@ -348,16 +887,24 @@ void Database::SplitPage(unsigned page)
     m_numberOfIndices++;
 
     // Advances next pointer
-    m_next = (m_next + 1) % (N * (TwoToThePower(m_level)));
-    if(m_next == 0) m_level++;
+    m_next = (m_next + 1) % m_levelSize;
+    if(m_next == 0)
+    {
+        m_level++;
+        UpdateLevelSize();
+    }
 
-    // Fill the next page with 0's
-    m_mainDataFile.seekp((m_numberOfIndices + 1) * MAIN_INDEX_SIZE + HEADER_SIZE - 1);
+    // Fill the next page with 0's.
+    // If the table shrank after a snapshot was created,
+    // the page may still be part of it.
+    PreservePage(0, m_numberOfIndices);
+    m_mainDataFile.seekp((m_numberOfIndices + 1) * MAIN_INDEX_SIZE + m_headerSize - 1);
     m_mainDataFile.write("", 1);
 
     // Fill all the extensions at the new page index with 0's
     for(unsigned i = 1; i <= m_currentMaxExtension; i++)
     {
+        PreservePage(i, m_numberOfIndices);
         std::fstream* dataFile = GetExtensionFile(i);
         dataFile->seekg((m_numberOfIndices + 1) * ENTRIES_PER_PAGE * ENTRY_SIZE - 1);
         dataFile->write("\0", 1);
@@ -382,7 +929,8 @@ void Database::MergePage(unsigned page)
     {
         // Find next next pointer position
         m_level--;
-        m_next = N * TwoToThePower(m_level) - 1;
+        UpdateLevelSize();
+        m_next = m_levelSize - 1;
 
     }
     DistributeEntries(page);
@@ -401,8 +949,242 @@ void Database::MergePage(unsigned page)
     UpdateMainHeader();    
 }
 
+void Database::SplitRange(unsigned first, unsigned last, unsigned numberOfThreads)
+{
+    unsigned numberOfIndices = m_numberOfIndices + (last - first);
+    GrowDataFiles(numberOfIndices);
+
+    RedistributionContext context;
+    context.nextIndex = first;
+    context.last = last;
+    context.numberOfIndices = numberOfIndices;
+    context.maxExtension = m_currentMaxExtension;
+    context.addedPages = 0;
+
+    // There is no point in having more threads than indices
+    numberOfThreads = std::min(numberOfThreads, last - first);
+
+    std::vector<std::thread> workers;
+    for(unsigned i = 1; i < numberOfThreads; i++)
+    {
+        workers.push_back(
+            std::thread(&Database::SplitRangeWorker, this, &context));
+    }
+    SplitRangeWorker(&context);
+
+    for(unsigned i = 0; i < workers.size(); i++) workers[i].join();
+
+    // Each split index creates a new page, plus its extensions
+    m_numberOfPages += (last - first) + context.addedPages;
+    m_numberOfIndices = numberOfIndices;
+    m_currentMaxExtension = context.maxExtension;
+
+    m_next = last % m_levelSize;
+    if(m_next == 0)
+    {
+        m_level++;
+        UpdateLevelSize();
+    }
+}
+
+void Database::SplitRangeWorker(RedistributionContext* context)
+{
+    std::fstream mainFile(
+        DATA_FILE_NAME_PREFIX + DATA_FILE_NAME_EXTENSION,
+        std::fstream::in    |
+        std::fstream::out   |
+        std::fstream::binary);
+
+    // Extension files opened by this worker, by extension number - 1
+    std::vector< std::unique_ptr<std::fstream> > extensionFiles;
+    auto getExtensionFile = [&](unsigned extensionNumber) -> std::fstream&
+    {
+        if(extensionFiles.size() < extensionNumber)
+        {
+            extensionFiles.resize(extensionNumber);
+        }
+
+        std::unique_ptr<std::fstream>& file = extensionFiles[extensionNumber - 1];
+        if(!file)
+        {
+            file.reset(new std::fstream(
+                DATA_FILE_NAME_PREFIX           +
+                std::to_string(extensionNumber) +
+                DATA_FILE_NAME_EXTENSION,
+                std::fstream::in    |
+                std::fstream::out   |
+                std::fstream::binary));
+        }
+
+        return *file;
+    };
+
+    std::vector<char> sourcePages;
+    std::vector<char> stayingPages;
+    std::vector<char> movingPages;
+    std::vector<Record> records;
+    std::vector<Record> staying;
+    std::vector<Record> moving;
+
+    while(true)
+    {
+        unsigned first = context->nextIndex.fetch_add(SPLIT_BATCH_SIZE);
+        if(first >= context->last) break;
+        unsigned last = std::min(first + SPLIT_BATCH_SIZE, context->last);
+
+        for(unsigned page = first; page < last; page++)
+        {
+            unsigned newPage = page + m_levelSize;
+
+            // Read the whole index, including extensions
+            IndexHeader ih;
+            mainFile.seekg(CalcIndexOffset(page));
+            mainFile.read((char *)&ih, INDEX_HEADER_SIZE);
+
+            // Nothing to move. The new index is already filled with 0's.
+            if(ih.numberOfEntries == 0) continue;
+
+            unsigned numberOfPages = ih.numberOfExtensions + 1;
+            sourcePages.resize(numberOfPages * INDEX_SIZE);
+            mainFile.read(&sourcePages[0], INDEX_SIZE);
+            for(unsigned i = 1; i < numberOfPages; i++)
+            {
+                std::fstream& file = getExtensionFile(i);
+                file.seekg(CalcIndexOffset(page, false));
+                file.read(&sourcePages[i * INDEX_SIZE], INDEX_SIZE);
+            }
+
+            records.clear();
+            for(unsigned i = 0; i < numberOfPages; i++)
+            {
+                const char* sourcePage = &sourcePages[i * INDEX_SIZE];
+                if(m_compressedPages)
+                {
+                    if(sourcePage[0] == 0) break;
+                    m_pageCodec->DecodePage(sourcePage, records);
+                    continue;
+                }
+
+                for(unsigned j = 0; j < ENTRIES_PER_PAGE; j++)
+                {
+                    const Entry* e = (const Entry*)&sourcePage[j * ENTRY_SIZE];
+                    if(IsEntryEmpty(e)) continue;
+
+                    records.push_back(*(const Record*)e);
+                }
+            }
+
+            // Separate the entries that stay from the ones that
+            // go to the new index
+            staying.clear();
+            moving.clear();
+            for(unsigned i = 0; i < records.size(); i++)
+            {
+                // The index at the next level depends on the parity
+                // of the quotient (see CalcIndex)
+                if((CalcKeyHash(records[i].key) / m_levelSize) & 1)
+                {
+                    moving.push_back(records[i]);
+                }
+                else
+                {
+                    staying.push_back(records[i]);
+                }
+            }
+
+            if(moving.empty()) continue;
+
+            // The original index keeps its extensions, which are now
+            // empty or partially filled. With compressed pages, the
+            // remaining entries may still need more pages than before.
+            unsigned numberOfStayingPages = BuildPages(staying, stayingPages);
+            unsigned numberOfSourcePages = std::max(numberOfPages, numberOfStayingPages);
+            stayingPages.resize(numberOfSourcePages * INDEX_SIZE, '\0');
+
+            // The new index has only as many extensions as needed
+            unsigned numberOfMovingPages = BuildPages(moving, movingPages);
+
+            unsigned maxExtension = std::max(numberOfSourcePages, numberOfMovingPages) - 1;
+            unsigned addedPages = (numberOfSourcePages - numberOfPages) + (numberOfMovingPages - 1);
+            if(maxExtension > 0 || addedPages > 0)
+            {
+                std::lock_guard<std::mutex> lock(context->mutex);
+                while(context->maxExtension < maxExtension)
+                {
+                    context->maxExtension++;
+                    GrowFile(
+                        DATA_FILE_NAME_PREFIX                        +
+                        std::to_string(context->maxExtension)        +
+                        DATA_FILE_NAME_EXTENSION,
+                        context->numberOfIndices * INDEX_SIZE,
+                        true);
+                }
+                context->addedPages += addedPages;
+            }
+
+            for(unsigned i = 0; i < numberOfSourcePages; i++) PreservePage(i, page);
+            for(unsigned i = 0; i < numberOfMovingPages; i++) PreservePage(i, newPage);
+
+            ih.numberOfEntries = staying.size();
+            ih.numberOfExtensions = numberOfSourcePages - 1;
+            mainFile.seekp(CalcIndexOffset(page));
+            mainFile.write((const char*)&ih, INDEX_HEADER_SIZE);
+            mainFile.write(&stayingPages[0], INDEX_SIZE);
+            for(unsigned i = 1; i < numberOfSourcePages; i++)
+            {
+                std::fstream& file = getExtensionFile(i);
+                file.seekp(CalcIndexOffset(page, false));
+                file.write(&stayingPages[i * INDEX_SIZE], INDEX_SIZE);
+            }
+
+            IndexHeader newIh;
+            newIh.numberOfEntries = moving.size();
+            newIh.numberOfExtensions = numberOfMovingPages - 1;
+            mainFile.seekp(CalcIndexOffset(newPage));
+            mainFile.write((const char*)&newIh, INDEX_HEADER_SIZE);
+            mainFile.write(&movingPages[0], INDEX_SIZE);
+            for(unsigned i = 1; i < numberOfMovingPages; i++)
+            {
+                std::fstream& file = getExtensionFile(i);
+                file.seekp(CalcIndexOffset(newPage, false));
+                file.write(&movingPages[i * INDEX_SIZE], INDEX_SIZE);
+            }
+        }
+    }
+}
+
+void Database::GrowDataFiles(unsigned numberOfIndices)
+{
+    // The last byte of the last index is written when growing
+    for(unsigned i = 0; i <= m_currentMaxExtension; i++)
+    {
+        PreservePage(i, numberOfIndices - 1);
+    }
+
+    GrowFile(
+        DATA_FILE_NAME_PREFIX + DATA_FILE_NAME_EXTENSION,
+        CalcIndexOffset(numberOfIndices),
+        false);
+
+    for(unsigned i = 1; i <= m_currentMaxExtension; i++)
+    {
+        GrowFile(
+            DATA_FILE_NAME_PREFIX   +
+            std::to_string(i)       +
+            DATA_FILE_NAME_EXTENSION,
+            CalcIndexOffset(numberOfIndices, false),
+            false);
+    }
+}
+
 void Database::DistributeEntries(unsigned page)
 {
+    if(m_compressedPages)
+    {
+        DistributeCompressedEntries(page);
+        return;
+    }
+
     IndexHeader originalIndexHeader;
     std::fstream* currentDataFile = &m_mainDataFile;
 
@@ -426,6 +1208,8 @@ void Database::DistributeEntries(unsigned page)
             unsigned hash = CalcHash(e.key);
             if(hash != page)
             {
+                PreservePage(index / ENTRIES_PER_PAGE, page);
+
                 // Returns pointer to beggining of entry
                 currentDataFile->seekp(
                     (unsigned)currentDataFile->tellp() - ENTRY_SIZE);
@@ -447,9 +1231,9 @@ void Database::DistributeEntries(unsigned page)
                     (unsigned)currentDataFile->tellp() + ENTRY_SIZE - 1);
 
                 // Insert into the new page
-                // Attention: InsertEntry will reposition the main data
-                // file pointers.
-                InsertEntry(e.key, e.value);
+                // Attention: InsertEntryAtIndex will reposition the main
+                // data file pointers.
+                InsertEntryAtIndex(hash, e.key, e.value);
 
                 // Get pointer again, because it might no longer
                 // be in memory
@@ -462,7 +1246,7 @@ void Database::DistributeEntries(unsigned page)
 
         index++;
         
-        if(index % ENTRIES_PER_PAGE == 0 && index < originalIndexNumberOfEntries)
+        if(index % ENTRIES_PER_PAGE == 0 && i < originalIndexNumberOfEntries)
         {
             currentDataFile = GetExtensionFile(index / ENTRIES_PER_PAGE);
             currentDataFile->seekg(CalcIndexOffset(page, false));
@@ -481,6 +1265,202 @@ void Database::DistributeEntries(unsigned page)
     UpdateIndexHeader(page, originalIndexHeader);
 }
 
+unsigned Database::ReadCompressedIndex(
+    unsigned index,
+    IndexHeader& outIh,
+    std::vector<Record>& outRecords)
+{
+    m_mainDataFile.seekg(CalcIndexOffset(index));
+    m_mainDataFile.read((char *)&outIh, INDEX_HEADER_SIZE);
+    if(outIh.numberOfEntries == 0) return 0;
+
+    std::vector<char> page(INDEX_SIZE);
+    unsigned pagesInUse = 0;
+    for(unsigned extension = 0; extension <= outIh.numberOfExtensions; extension++)
+    {
+        if(extension == 0)
+        {
+            m_mainDataFile.read(&page[0], INDEX_SIZE);
+        }
+        else
+        {
+            std::fstream* dataFile = GetExtensionFile(extension);
+            dataFile->seekg(CalcIndexOffset(index, false));
+            dataFile->read(&page[0], INDEX_SIZE);
+        }
+
+        // Pages are filled in order, so the first
+        // empty one marks the end of the index
+        if(page[0] == 0) break;
+
+        m_pageCodec->DecodePage(&page[0], outRecords);
+        pagesInUse++;
+    }
+
+    return pagesInUse;
+}
+
+void Database::WriteCompressedIndex(
+    unsigned index,
+    IndexHeader& ih,
+    std::vector<Record>& records,
+    unsigned pagesInUse)
+{
+    std::vector<char> pages;
+    unsigned numberOfPages = BuildPages(records, pages);
+
+    // The ratio measured since the database was opened
+    // replaces the one stored in the header
+    PageCodecStats stats = m_pageCodec->GetStats();
+    m_compressionRatio = std::max(1.0, stats.GetCompressionRatio());
+
+    while(ih.numberOfExtensions + 1 < numberOfPages)
+    {
+        ih.numberOfExtensions++;
+        if(ih.numberOfExtensions > m_currentMaxExtension)
+        {
+            CreateExtensionFile(ih.numberOfExtensions);
+            m_currentMaxExtension++;
+        }
+        m_numberOfPages++;
+    }
+
+    // Pages that held entries before, but don't anymore, are cleared
+    unsigned pagesToWrite = std::max(numberOfPages, pagesInUse);
+    pages.resize(pagesToWrite * INDEX_SIZE, '\0');
+
+    ih.numberOfEntries = records.size();
+
+    PreservePage(0, index);
+    m_mainDataFile.seekp(CalcIndexOffset(index));
+    m_mainDataFile.write((const char*)&ih, INDEX_HEADER_SIZE);
+    m_mainDataFile.write(&pages[0], INDEX_SIZE);
+
+    for(unsigned extension = 1; extension < pagesToWrite; extension++)
+    {
+        PreservePage(extension, index);
+        std::fstream* dataFile = GetExtensionFile(extension);
+        dataFile->seekp(CalcIndexOffset(index, false));
+        dataFile->write(&pages[extension * INDEX_SIZE], INDEX_SIZE);
+    }
+}
+
+int Database::GetCompressedEntry(unsigned index, const char key[21], std::vector<std::string>& outValues)
+{
+    IndexHeader ih;
+    m_mainDataFile.seekg(CalcIndexOffset(index));
+    m_mainDataFile.read((char *)&ih, INDEX_HEADER_SIZE);
+    if(ih.numberOfEntries == 0) return 0;
+
+    std::vector<char> page(INDEX_SIZE);
+    unsigned numberFound = 0;
+    for(unsigned extension = 0; extension <= ih.numberOfExtensions; extension++)
+    {
+        if(extension == 0)
+        {
+            m_mainDataFile.read(&page[0], INDEX_SIZE);
+        }
+        else
+        {
+            std::fstream* dataFile = GetExtensionFile(extension);
+            dataFile->seekg(CalcIndexOffset(index, false));
+            dataFile->read(&page[0], INDEX_SIZE);
+        }
+
+        if(page[0] == 0) break;
+
+        // Keys are sorted across the pages of an index, so the
+        // search stops at the first page with bigger keys
+        bool pastKey = false;
+        numberFound += m_pageCodec->FindKey(&page[0], key, m_uniqueKeys, outValues, pastKey);
+        if(pastKey || (m_uniqueKeys && numberFound > 0)) break;
+    }
+
+    if(numberFound > 0) return 1;
+    return 0;
+}
+
+unsigned Database::DeleteCompressedEntry(unsigned index, const char key[21])
+{
+    IndexHeader ih;
+    std::vector<Record> records;
+    unsigned pagesInUse = ReadCompressedIndex(index, ih, records);
+
+    unsigned numberOfRecords = records.size();
+    for(unsigned i = 0; i < records.size();)
+    {
+        if(strncmp(records[i].key, key, KEY_SIZE) == 0)
+        {
+            records.erase(records.begin() + i);
+
+            // There can't be any other entry with the same key
+            if(m_uniqueKeys) break;
+        }
+        else i++;
+    }
+
+    unsigned numberDeleted = numberOfRecords - records.size();
+    if(numberDeleted == 0) return 0;
+
+    WriteCompressedIndex(index, ih, records, pagesInUse);
+    m_numberOfEntries -= numberDeleted;
+    return numberDeleted;
+}
+
+void Database::DistributeCompressedEntries(unsigned page)
+{
+    IndexHeader ih;
+    std::vector<Record> records;
+    unsigned pagesInUse = ReadCompressedIndex(page, ih, records);
+    if(records.empty()) return;
+
+    std::vector<Record> staying;
+    std::map< unsigned, std::vector<Record> > moving;
+    for(unsigned i = 0; i < records.size(); i++)
+    {
+        unsigned hash = CalcHash(records[i].key);
+        if(hash == page) staying.push_back(records[i]);
+        else moving[hash].push_back(records[i]);
+    }
+
+    if(moving.empty()) return;
+
+    WriteCompressedIndex(page, ih, staying, pagesInUse);
+
+    // Each destination index is rewritten once, with
+    // all its new entries. The total number of entries
+    // doesn't change.
+    for(auto destination = moving.begin(); destination != moving.end(); destination++)
+    {
+        IndexHeader destinationIh;
+        std::vector<Record> destinationRecords;
+        unsigned destinationPagesInUse = ReadCompressedIndex(
+            destination->first, destinationIh, destinationRecords);
+
+        destinationRecords.insert(
+            destinationRecords.end(),
+            destination->second.begin(),
+            destination->second.end());
+
+        WriteCompressedIndex(
+            destination->first, destinationIh, destinationRecords, destinationPagesInUse);
+    }
+}
+
+unsigned Database::BuildPages(std::vector<Record>& records, std::vector<char>& outPages)
+{
+    if(m_compressedPages)
+    {
+        PageCodec::SortRecords(records);
+        return m_pageCodec->EncodePages(records, outPages);
+    }
+
+    unsigned numberOfPages = records.empty() ? 1 : (records.size() - 1) / ENTRIES_PER_PAGE + 1;
+    outPages.assign(numberOfPages * INDEX_SIZE, '\0');
+    if(!records.empty()) memcpy(&outPages[0], &records[0], records.size() * ENTRY_SIZE);
+    return numberOfPages;
+}
+
 void Database::ExtendIndex(unsigned index)
 {
     m_mainDataFile.seekg(CalcIndexOffset(index));
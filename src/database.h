@@ -6,7 +6,11 @@
 
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -18,8 +22,58 @@ struct Entry
 };
 #pragma pack(pop)
 
+// Entry with writable fields, used while building pages
+// and snapshots
+#pragma pack(push, 1)
+struct Record
+{
+    char key[21];
+    char value[51];
+};
+#pragma pack(pop)
+
+static_assert(sizeof(Record) == sizeof(Entry), "Record must have the layout of Entry");
+
+// Returns the length of a key or value stored in a field of size
+// bytes. Bytes after the terminator are not guaranteed to be zero,
+// and a field that is completely used has no terminator.
+inline unsigned FieldLength(const char* field, unsigned size)
+{
+    const void* end = memchr(field, '\0', size);
+    return end ? (const char*)end - field : size;
+}
+
+// Header of the main data file. Files of older versions hold
+// only the fields their version knows about, and files written
+// before the header had a magic and a version start with a
+// LegacyHeader instead (see Database::Database).
 #pragma pack(push, 1)
 struct Header
+{
+    char magic[8];
+    unsigned version;
+    unsigned N;
+    unsigned level;
+    unsigned numberOfPages;
+    unsigned numberOfEntries;
+    unsigned numberOfIndices;
+    unsigned next;
+    unsigned currentMaxExtension;
+    unsigned hashFunction;
+    unsigned uniqueKeys;
+    // Size below which version 3 didn't merge the table.
+    // No longer used, and always 0.
+    unsigned reservedIndices;
+    unsigned compressedPages;
+    // Compression ratio of compressed pages, in thousandths
+    unsigned compressionRatio;
+};
+#pragma pack(pop)
+
+// Header of the first version of the main data file, which
+// had neither a magic nor a version, and always used FNV-1a
+#pragma pack(push, 1)
+struct LegacyHeader
 {
     unsigned N;
     unsigned level;
@@ -31,6 +85,17 @@ struct Header
 };
 #pragma pack(pop)
 
+// Shared state of the threads redistributing entries in Reserve
+struct RedistributionContext;
+
+// See onlinesnapshot.h
+struct SnapshotState;
+class OnlineSnapshot;
+
+// See pagecodec.h
+class PageCodec;
+struct PageCodecStats;
+
 #pragma pack(push, 1)
 struct IndexHeader
 {
@@ -39,20 +104,134 @@ struct IndexHeader
 };
 #pragma pack(pop)
 
-class Database 
+// Hash functions available to map keys to indices.
+// The function is chosen when the main data file is created
+// and is recorded in its header, so a database keeps using
+// the same function for its whole life.
+enum class HashFunction : unsigned
+{
+    // Byte-at-a-time FNV-1a (the original hash)
+    FNV1A = 0,
+    // Word-at-a-time hash using wyhash-style multiply mixing
+    WY64 = 1
+};
+
+// Interface shared by everything entries can be read from
+// (a Database, or a read-only Snapshot of one)
+class EntrySource
 {
 public:
-    explicit Database();
+    virtual ~EntrySource() { }
+
+    // Stores the values of every entry with the key into outValues.
+    // Returns 1, if any entry is found.
+    // Returns 0 otherwise.
+    virtual int GetEntry(const char key[21], std::vector<std::string>& outValues) = 0;
+};
+
+class Database : public EntrySource
+{
+public:
+    // hashFunction, uniqueKeys and compressedPages are only used when
+    // the database is created. When opening an existing database,
+    // the values recorded in its header are used instead.
+    // Files of older versions, or written before the header was
+    // versioned, are still opened (and kept in their format). The
+    // options they don't record default to FNV-1a, duplicated keys
+    // and uncompressed pages.
+    // In unique key mode each key is stored at most once: inserting
+    // a key that is already stored overwrites its value, as
+    // UpsertEntry does. This allows lookups and deletions to stop
+    // at the first match.
+    // With compressed pages, each index is stored through PageCodec,
+    // so more entries fit in a page. Every change to an index then
+    // rewrites its pages, instead of a single entry.
+    explicit Database(
+        HashFunction hashFunction = HashFunction::FNV1A,
+        bool uniqueKeys = false,
+        bool compressedPages = false);
     ~Database();
 
+    // Returns false if the main data file couldn't be opened,
+    // or has an unknown format. The database can't be used then.
+    bool IsOpen() const { return m_mainDataFile.is_open(); }
+
+    // Inserts an entry. In unique key mode, if there is already
+    // an entry with the key, its value is overwritten instead.
+    // Returns 1 if an entry was overwritten.
+    // Returns 0 otherwise.
     int InsertEntry(const char key[21], const char value[51]);
 
+    // Same as InsertEntry, for keys already hashed by
+    // CalcKeyHash or CalcKeyHashes
+    int InsertHashedEntry(unsigned keyHash, const char key[21], const char value[51]);
+
     // Stores entry into outValue if entry is found in the database.
     // Returns 1, if entry is found.
     // Returns 0 otherwise, and keeps outValue unchanged
-    int GetEntry(const char key[21], std::vector<std::string>& outValues);
+    // In unique key mode, stops at the first entry found.
+    int GetEntry(const char key[21], std::vector<std::string>& outValues) override;
+
+    // Deletes every entry with the key, or only the first one
+    // in unique key mode.
+    // Returns 1 if at least one entry was deleted.
+    // Returns 0 otherwise.
     int DeleteEntry(const char key[21]);
 
+    // Overwrites the value of the first entry with the key in place.
+    // If there is no such entry, inserts a new one.
+    // Returns 1 if an entry was updated.
+    // Returns 0 if a new entry was inserted.
+    int UpsertEntry(const char key[21], const char value[51]);
+
+    // Grows the table until it has at least numberOfIndices indices.
+    // Each round of splits is done by numberOfThreads threads
+    // (or one per core, if 0), each one working on its own range
+    // of indices and writing the moved entries directly into the
+    // new pages. This only grows the table ahead of time: it may
+    // shrink again as entries are deleted, like any other table.
+    void Reserve(unsigned numberOfIndices, unsigned numberOfThreads = 0);
+
+    // Freezes the current state of the database. Pages changed
+    // afterwards are copied before being written, so the frozen
+    // view can be read (e.g. to back the database up) while the
+    // database keeps being changed.
+    // Only one snapshot can be alive at a time. Returns nullptr
+    // if there is already one.
+    std::unique_ptr<OnlineSnapshot> CreateSnapshot();
+
+    // Calls callback with the entries of each index that has any,
+    // one index at a time. Entries with the same key are always in
+    // the same index. Keys and values are padded with 0's, and the
+    // callback may reorder them.
+    void ForEachIndex(const std::function<void(std::vector<Record>&)>& callback);
+
+    unsigned GetNumberOfEntries() const { return m_numberOfEntries; }
+
+    // Returns the full hash of a key, before it is reduced
+    // to an index. It depends only on the key and the hash
+    // function, so it stays valid when the table grows.
+    unsigned CalcKeyHash(const char key[21]) const;
+
+    // Hashes count keys at once into outHashes.
+    // Keys are laid out contiguously, KEY_SIZE bytes each.
+    void CalcKeyHashes(const char* keys, unsigned count, unsigned* outHashes) const;
+
+    // Returns the index a key hash maps to with the current
+    // level and next pointer
+    unsigned CalcIndex(unsigned keyHash) const;
+
+    HashFunction GetHashFunction() const { return m_hashFunction; }
+    bool HasUniqueKeys() const { return m_uniqueKeys; }
+    bool HasCompressedPages() const { return m_compressedPages; }
+
+    // Compression ratio and time spent encoding and decoding pages
+    // since the database was opened
+    PageCodecStats GetPageCodecStats() const;
+
+    static const unsigned KEY_SIZE = 21;
+    static const unsigned VALUE_SIZE = 51;
+
 private:
     std::fstream m_mainDataFile;
     std::vector< std::pair<unsigned, std::fstream> > m_indexExtensionsDataFiles;
@@ -76,10 +255,22 @@ private:
 
     // Store the database current state to the main data file
     void UpdateMainHeader();
+    Header MakeHeader() const;
+
+    // Must be called before writing to a page, so the alive
+    // snapshot (if any) keeps its contents.
+    // Extension number 0 is the main data file.
+    void PreservePage(unsigned extensionNumber, unsigned index);
     void UpdateIndexHeader(unsigned index, const IndexHeader& ih);
 
     unsigned CalcHash(const char key[21]);
 
+    unsigned HashFNV1a(const char key[21]) const;
+    unsigned HashWY64(const char key[21]) const;
+
+    // Must be called whenever m_level changes
+    void UpdateLevelSize();
+
     unsigned TwoToThePower(int exponent);
 
     // Returns the position in the file of an index
@@ -92,6 +283,19 @@ private:
     // Finds the first empty slot in an index (considering extensions)
     unsigned FindFirstEmptySlot(unsigned index);
 
+    // Finds the position of the first entry with the key in an
+    // index (considering extensions), reading the index header
+    // into outIh.
+    // Returns true and stores it into outPosition if found.
+    // Returns false otherwise, and stores the first empty slot of
+    // the index into outPosition (which is right past its last page
+    // if the index is full).
+    bool FindEntry(
+        unsigned index,
+        const char key[21],
+        IndexHeader& outIh,
+        unsigned& outPosition);
+
     void WriteEntryAtPosition(
         const char key[21], 
         const char value[51], 
@@ -128,12 +332,88 @@ private:
     // or the behavior of the function is undefined
     std::fstream* GetExtensionFile(unsigned extensionNumber);
 
+    // Inserts an entry whose index has already been calculated,
+    // even if the key is already stored
+    int InsertEntryAtIndex(unsigned index, const char key[21], const char value[51]);
+
+    // Writes an entry at a slot known to be empty, extending the
+    // index if the slot is right past its last page, and splits
+    // the table if needed. ih must hold the current index header.
+    void InsertEntryAtSlot(
+        unsigned index,
+        IndexHeader& ih,
+        unsigned position,
+        const char key[21],
+        const char value[51]);
+
+    int UpsertEntryAtIndex(unsigned index, const char key[21], const char value[51]);
+
+    // Splits the next index when the max limit is exceeded
+    void SplitIfNeeded();
+
+    // Merges indices while the load is under the min limit
+    void MergeIfNeeded();
+
+    // Reads and decodes every entry of an index stored with
+    // compressed pages.
+    // Returns the number of pages holding entries.
+    unsigned ReadCompressedIndex(
+        unsigned index,
+        IndexHeader& outIh,
+        std::vector<Record>& outRecords);
+
+    // Replaces the entries of an index stored with compressed pages,
+    // extending it if needed. pagesInUse is the value returned by
+    // ReadCompressedIndex; pages after it are already empty.
+    // Updates the index header, but not the main header.
+    void WriteCompressedIndex(
+        unsigned index,
+        IndexHeader& ih,
+        std::vector<Record>& records,
+        unsigned pagesInUse);
+
+    int GetCompressedEntry(unsigned index, const char key[21], std::vector<std::string>& outValues);
+
+    // Returns the number of entries deleted
+    unsigned DeleteCompressedEntry(unsigned index, const char key[21]);
+
+    void DistributeCompressedEntries(unsigned page);
+
+    // Lays records out in pages, in the format used by the database.
+    // Returns the number of pages (at least one).
+    unsigned BuildPages(std::vector<Record>& records, std::vector<char>& outPages);
+
+    // Splits every index in [first, last) at once, using numberOfThreads
+    // threads. The indices must belong to the current level.
+    void SplitRange(unsigned first, unsigned last, unsigned numberOfThreads);
+
+    // Splits the indices handed out by context, using its own
+    // file streams. Runs on the threads started by SplitRange.
+    void SplitRangeWorker(RedistributionContext* context);
+
+    // Makes sure every data file has room for numberOfIndices indices
+    void GrowDataFiles(unsigned numberOfIndices);
+
+    HashFunction m_hashFunction;
+    bool m_uniqueKeys;
+    bool m_compressedPages;
+    // Used to estimate how many entries a compressed page holds
+    float m_compressionRatio;
     unsigned m_level;
+    // N * 2^m_level, cached to avoid recalculating it on every hash
+    unsigned m_levelSize;
     unsigned m_next;
     unsigned m_numberOfEntries;
     unsigned m_numberOfIndices;
     unsigned m_numberOfPages;
     unsigned m_currentMaxExtension;
+    // Version of the layout of the main data file,
+    // 0 if it starts with a LegacyHeader
+    unsigned m_version;
+    // Size of the header of the main data file, where the indices start
+    unsigned m_headerSize;
+
+    std::shared_ptr<SnapshotState> m_snapshotState;
 
     const float MIN_LIMIT = 0.3f;
     const float MAX_LIMIT = 0.8f;
@@ -141,10 +421,12 @@ private:
     const unsigned ENTRIES_PER_PAGE = 11;
     const std::string DATA_FILE_NAME_PREFIX = "data";
     const std::string DATA_FILE_NAME_EXTENSION = ".dat";
-    const unsigned HEADER_SIZE = sizeof(Header);
     const unsigned ENTRY_SIZE = sizeof(Entry);
     const unsigned INDEX_HEADER_SIZE = sizeof(IndexHeader);
     const unsigned INDEX_SIZE = ENTRIES_PER_PAGE * ENTRY_SIZE;
     const unsigned MAIN_INDEX_SIZE = INDEX_SIZE + INDEX_HEADER_SIZE;
     const unsigned MAX_SIMULTANEOUS_EXTENSIONS_OPEN = 5;
+
+    // Must come after INDEX_SIZE, which it is constructed from
+    std::unique_ptr<PageCodec> m_pageCodec;
 };
\ No newline at end of file
@@ -1,22 +1,122 @@
 #include "database.h"
+#include "onlinesnapshot.h"
+#include "snapshot.h"
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Opens the database in the current directory. The options
+// ("wy64", "unique" and "compressed", separated by spaces)
+// are only used if the database is created.
+static Database* OpenDatabase(const std::string& options)
+{
+    HashFunction hashFunction = HashFunction::FNV1A;
+    bool uniqueKeys = false;
+    bool compressedPages = false;
+
+    std::istringstream stream(options);
+    std::string option;
+    while(stream >> option)
+    {
+        if(option == "wy64") hashFunction = HashFunction::WY64;
+        else if(option == "unique") uniqueKeys = true;
+        else if(option == "compressed") compressedPages = true;
+    }
+
+    Database* db = new Database(hashFunction, uniqueKeys, compressedPages);
+    if(!db->IsOpen())
+    {
+        std::cerr << "Error: Unable to open the data file, or its format is unknown." << std::endl;
+        delete db;
+        return nullptr;
+    }
+
+    return db;
+}
+
+static void PrintValues(const char key[21], const std::vector<std::string>& values)
+{
+    for(unsigned i = 0; i < values.size(); i++)
+    {
+        std::cout << key << " " << values[i] << std::endl;
+    }
+}
+
+static bool IsNumber(const std::string& text)
+{
+    return !text.empty() &&
+        text.size() <= 9 &&
+        text.find_first_not_of("0123456789") == std::string::npos;
+}
 
 int main(int argc, char* args[])
 {
-    Database db;
+    // Opened by the first command that needs it,
+    // so 'o' can choose how it is created
+    std::unique_ptr<Database> db;
+    std::unique_ptr<Snapshot> snapshot;
+    std::unique_ptr<OnlineSnapshot> frozenView;
 
     while(true)
     {
         char c[2];
         std::cin.getline(c, 2);
 
+        if(c[0] == 'o')
+        {
+            // Reopens the database, with the options given
+            char options[51];
+            std::cin.getline(options, 51);
+
+            frozenView.reset();
+            db.reset();
+            db.reset(OpenDatabase(options));
+            if(!db) return 1;
+            continue;
+        }
+        else if(c[0] == 'd')
+        {
+            // Moves to another directory (created if needed),
+            // where the database is opened again
+            char directory[51];
+            std::cin.getline(directory, 51);
+
+            frozenView.reset();
+            db.reset();
+            mkdir(directory, 0755);
+            if(chdir(directory) != 0)
+            {
+                std::cerr << "Error: Unable to enter directory: " << directory << std::endl;
+                return 1;
+            }
+            continue;
+        }
+
+        if(c[0] != '\0' && !db)
+        {
+            db.reset(OpenDatabase(""));
+            if(!db) return 1;
+        }
+
         if(c[0] == 'i')
         {
             char key[21];
             char value[51];
             std::cin.getline(key, 21);
             std::cin.getline(value, 51);
-            db.InsertEntry(key, value);
+            db->InsertEntry(key, value);
+        }
+        else if(c[0] == 'u')
+        {
+            char key[21];
+            char value[51];
+            std::cin.getline(key, 21);
+            std::cin.getline(value, 51);
+            db->UpsertEntry(key, value);
         }
         else if(c[0] == 'c')
         {
@@ -24,23 +124,93 @@ int main(int argc, char* args[])
             std::cin.getline(searchToken, 21);
 
             std::vector<std::string> values;
-            if(db.GetEntry(searchToken, values) != 0)
-            {
-                for(unsigned i = 0; i < values.size(); i++)
-                {
-                    std::cout << searchToken << " " << values[i] << std::endl;
-                }
-            }
+            if(db->GetEntry(searchToken, values) != 0) PrintValues(searchToken, values);
         }
         else if(c[0] == 'r')
         {
             char deleteToken[21];
             std::cin.getline(deleteToken, 21);
 
-            db.DeleteEntry(deleteToken);
+            db->DeleteEntry(deleteToken);
+        }
+        else if(c[0] == 'n')
+        {
+            std::cout << "entries " << db->GetNumberOfEntries() << std::endl;
+        }
+        else if(c[0] == 'g')
+        {
+            // Grows the table to the number of indices given
+            char numberOfIndices[11];
+            std::cin.getline(numberOfIndices, 11);
+            if(std::cin.fail())
+            {
+                // The line was too long, skip the rest of it
+                std::cin.clear();
+                std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            }
+
+            if(!IsNumber(numberOfIndices))
+            {
+                std::cerr << "Error: Invalid number of indices: " << numberOfIndices << std::endl;
+                continue;
+            }
+
+            db->Reserve(std::stoul(numberOfIndices));
+        }
+        else if(c[0] == 'x')
+        {
+            // Exports the database to a snapshot file, and maps it
+            char fileName[51];
+            std::cin.getline(fileName, 51);
+
+            snapshot.reset();
+            if(!Snapshot::Export(*db, fileName))
+            {
+                std::cerr << "Error: Unable to export snapshot: " << fileName << std::endl;
+                return 1;
+            }
+
+            snapshot.reset(new Snapshot(fileName));
+            if(!snapshot->IsOpen())
+            {
+                std::cerr << "Error: Unable to open snapshot: " << fileName << std::endl;
+                return 1;
+            }
+        }
+        else if(c[0] == 'k')
+        {
+            // Same as 'c', on the snapshot exported by 'x'
+            char searchToken[21];
+            std::cin.getline(searchToken, 21);
+
+            std::vector<std::string> values;
+            if(snapshot && snapshot->GetEntry(searchToken, values) != 0)
+            {
+                PrintValues(searchToken, values);
+            }
+        }
+        else if(c[0] == 'f')
+        {
+            // Freezes the current state of the database
+            frozenView = db->CreateSnapshot();
+        }
+        else if(c[0] == 'w')
+        {
+            // Writes the state frozen by 'f' to a directory
+            // (created if needed), and releases it
+            char directory[51];
+            std::cin.getline(directory, 51);
+
+            mkdir(directory, 0755);
+            if(!frozenView || !frozenView->WriteTo(std::string(directory) + "/data"))
+            {
+                std::cerr << "Error: Unable to write frozen view to: " << directory << std::endl;
+                return 1;
+            }
+            frozenView.reset();
         }
         else break;
     }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,198 @@
+#include "onlinesnapshot.h"
+#include <cstdio>
+#include <cstring>
+
+SnapshotState::SnapshotState(
+    const Header& frozenHeader,
+    const std::string& fileNamePrefix,
+    const std::string& fileNameExtension,
+    unsigned headerSize,
+    unsigned mainPageSize,
+    unsigned extensionPageSize)
+    : header(frozenHeader),
+    fileNameExtension(fileNameExtension),
+    headerSize(headerSize),
+    mainPageSize(mainPageSize),
+    extensionPageSize(extensionPageSize),
+    released(false),
+    m_fileNamePrefix(fileNamePrefix),
+    m_copyOnWriteFileName(fileNamePrefix + "snapshot.cow"),
+    m_copyOnWriteFileSize(0)
+{
+    m_copyOnWriteFile.open(m_copyOnWriteFileName,
+        std::fstream::in    |
+        std::fstream::out   |
+        std::fstream::trunc |
+        std::fstream::binary);
+}
+
+SnapshotState::~SnapshotState()
+{
+    Release();
+}
+
+void SnapshotState::Preserve(unsigned extensionNumber, unsigned index)
+{
+    // Pages created after the snapshot are not part of it
+    if(released) return;
+    if(index >= header.numberOfIndices) return;
+    if(extensionNumber > header.currentMaxExtension) return;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(released) return;
+
+    uint64_t key = (uint64_t)extensionNumber << 32 | index;
+    if(m_preservedPages.count(key) != 0) return;
+
+    // The page hasn't changed since the snapshot was created,
+    // so the data files still hold its frozen contents
+    std::vector<char> page(extensionNumber == 0 ? mainPageSize : extensionPageSize);
+    ReadLivePage(extensionNumber, index, &page[0]);
+
+    m_copyOnWriteFile.seekp(m_copyOnWriteFileSize);
+    m_copyOnWriteFile.write(&page[0], page.size());
+    m_preservedPages[key] = m_copyOnWriteFileSize;
+    m_copyOnWriteFileSize += page.size();
+}
+
+bool SnapshotState::ReadPage(unsigned extensionNumber, unsigned index, std::vector<char>& outPage)
+{
+    if(index >= header.numberOfIndices) return false;
+    if(extensionNumber > header.currentMaxExtension) return false;
+
+    outPage.resize(extensionNumber == 0 ? mainPageSize : extensionPageSize);
+
+    // The lock is held while reading the data files, so the page
+    // can't be changed before being preserved
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    auto preserved = m_preservedPages.find((uint64_t)extensionNumber << 32 | index);
+    if(preserved != m_preservedPages.end())
+    {
+        m_copyOnWriteFile.seekg(preserved->second);
+        m_copyOnWriteFile.read(&outPage[0], outPage.size());
+        return true;
+    }
+
+    return ReadLivePage(extensionNumber, index, &outPage[0]);
+}
+
+void SnapshotState::Release()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if(released) return;
+
+    released = true;
+    m_dataFiles.clear();
+    m_preservedPages.clear();
+    m_copyOnWriteFile.close();
+    std::remove(m_copyOnWriteFileName.c_str());
+}
+
+bool SnapshotState::ReadLivePage(unsigned extensionNumber, unsigned index, char* outPage)
+{
+    std::fstream* file = GetDataFile(extensionNumber);
+    unsigned pageSize = extensionNumber == 0 ? mainPageSize : extensionPageSize;
+    uint64_t offset = extensionNumber == 0 ?
+        headerSize + (uint64_t)index * mainPageSize :
+        (uint64_t)index * extensionPageSize;
+
+    file->seekg(offset);
+    file->read(outPage, pageSize);
+
+    // Pages past the end of the file were never written
+    unsigned bytesRead = file->gcount();
+    if(bytesRead < pageSize)
+    {
+        memset(outPage + bytesRead, 0, pageSize - bytesRead);
+        file->clear();
+    }
+
+    return true;
+}
+
+std::fstream* SnapshotState::GetDataFile(unsigned extensionNumber)
+{
+    std::unique_ptr<std::fstream>& file = m_dataFiles[extensionNumber];
+    if(!file)
+    {
+        file.reset(new std::fstream(
+            m_fileNamePrefix                                                   +
+            (extensionNumber == 0 ? "" : std::to_string(extensionNumber))     +
+            fileNameExtension,
+            std::fstream::in |
+            std::fstream::binary));
+    }
+
+    return file.get();
+}
+
+OnlineSnapshot::OnlineSnapshot(const std::shared_ptr<SnapshotState>& state)
+    : m_state(state)
+{ }
+
+OnlineSnapshot::~OnlineSnapshot()
+{
+    m_state->Release();
+}
+
+bool OnlineSnapshot::ReadPage(unsigned extensionNumber, unsigned index, std::vector<char>& outPage)
+{
+    return m_state->ReadPage(extensionNumber, index, outPage);
+}
+
+bool OnlineSnapshot::WriteTo(const std::string& fileNamePrefix)
+{
+    const Header& header = m_state->header;
+    std::vector<char> page;
+
+    std::ofstream mainFile(
+        fileNamePrefix + m_state->fileNameExtension,
+        std::ofstream::out | std::ofstream::binary);
+    if(!mainFile.is_open()) return false;
+
+    mainFile.write((const char*)&header, sizeof(Header));
+
+    // Pages past the extensions of an index are empty,
+    // so only the extensions in use are copied
+    std::vector<unsigned> numberOfExtensions(header.numberOfIndices);
+    for(unsigned index = 0; index < header.numberOfIndices; index++)
+    {
+        m_state->ReadPage(0, index, page);
+        mainFile.write(&page[0], page.size());
+
+        IndexHeader ih;
+        memcpy(&ih, &page[0], sizeof(IndexHeader));
+        numberOfExtensions[index] = ih.numberOfEntries == 0 ? 0 : ih.numberOfExtensions;
+    }
+
+    // Leave room for the next index, as the database does
+    mainFile.seekp(
+        sizeof(Header) + (uint64_t)(header.numberOfIndices + 1) * m_state->mainPageSize - 1);
+    mainFile.write("", 1);
+    if(!mainFile.good()) return false;
+
+    for(unsigned extension = 1; extension <= header.currentMaxExtension; extension++)
+    {
+        std::ofstream extensionFile(
+            fileNamePrefix + std::to_string(extension) + m_state->fileNameExtension,
+            std::ofstream::out | std::ofstream::binary);
+        if(!extensionFile.is_open()) return false;
+
+        for(unsigned index = 0; index < header.numberOfIndices; index++)
+        {
+            if(numberOfExtensions[index] < extension) continue;
+
+            m_state->ReadPage(extension, index, page);
+            extensionFile.seekp((uint64_t)index * m_state->extensionPageSize);
+            extensionFile.write(&page[0], page.size());
+        }
+
+        extensionFile.seekp(
+            (uint64_t)(header.numberOfIndices + 1) * m_state->extensionPageSize - 1);
+        extensionFile.write("", 1);
+        if(!extensionFile.good()) return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "database.h"
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// State shared by a Database and the OnlineSnapshot it created.
+//
+// The Database calls Preserve before changing a page that is part
+// of the frozen view, which copies the page (as it was when the
+// snapshot was created) to the copy-on-write file. Only the first
+// change of each page is copied.
+//
+// Pages are identified by their file (0 for the main data file,
+// or the extension number) and their index. Pages of the main data
+// file include the index header.
+struct SnapshotState
+{
+    SnapshotState(
+        const Header& frozenHeader,
+        const std::string& fileNamePrefix,
+        const std::string& fileNameExtension,
+        unsigned headerSize,
+        unsigned mainPageSize,
+        unsigned extensionPageSize);
+    ~SnapshotState();
+
+    // Copies the page to the copy-on-write file, if it belongs
+    // to the frozen view and wasn't copied yet.
+    // Thread-safe.
+    void Preserve(unsigned extensionNumber, unsigned index);
+
+    // Reads a page of the frozen view, either from the
+    // copy-on-write file, or from the data files if it
+    // hasn't changed.
+    // Returns false if the page doesn't belong to the frozen view.
+    // Thread-safe.
+    bool ReadPage(unsigned extensionNumber, unsigned index, std::vector<char>& outPage);
+
+    // Stops copying pages, and removes the copy-on-write file
+    void Release();
+
+    const Header header;
+    const std::string fileNameExtension;
+    // Size of the header of the live main data file, which
+    // may be a LegacyHeader or a Header of an older version.
+    // Files written by WriteTo always start with a Header.
+    const unsigned headerSize;
+    const unsigned mainPageSize;
+    const unsigned extensionPageSize;
+    std::atomic<bool> released;
+
+private:
+    // Reads a page from the data files. Must be called with mutex held.
+    bool ReadLivePage(unsigned extensionNumber, unsigned index, char* outPage);
+
+    std::fstream* GetDataFile(unsigned extensionNumber);
+
+    std::mutex m_mutex;
+
+    std::string m_fileNamePrefix;
+
+    // Streams opened by the snapshot itself, by extension number,
+    // so the positions of the Database's streams are never touched
+    std::unordered_map<unsigned, std::unique_ptr<std::fstream> > m_dataFiles;
+
+    std::string m_copyOnWriteFileName;
+    std::fstream m_copyOnWriteFile;
+    uint64_t m_copyOnWriteFileSize;
+
+    // Position of each preserved page in the copy-on-write file,
+    // by (extension number << 32 | index)
+    std::unordered_map<uint64_t, uint64_t> m_preservedPages;
+};
+
+// Point-in-time view of a database, created by
+// Database::CreateSnapshot. The database can keep being
+// changed while the view is read; the cost of keeping the
+// view is one copy of each page changed since its creation.
+class OnlineSnapshot
+{
+public:
+    explicit OnlineSnapshot(const std::shared_ptr<SnapshotState>& state);
+
+    // Releases the view. The database stops copying pages.
+    ~OnlineSnapshot();
+
+    OnlineSnapshot(const OnlineSnapshot&) = delete;
+    OnlineSnapshot& operator=(const OnlineSnapshot&) = delete;
+
+    // Header of the database when the snapshot was created
+    const Header& GetHeader() const { return m_state->header; }
+
+    // Reads a page of the frozen view. Extension number 0 is the
+    // main data file, whose pages start with the index header.
+    // Returns false if the page doesn't belong to the frozen view.
+    bool ReadPage(unsigned extensionNumber, unsigned index, std::vector<char>& outPage);
+
+    // Writes the frozen view as a new set of data files
+    // (fileNamePrefix.dat, fileNamePrefix1.dat, ...), which can be
+    // opened as a database on their own.
+    // Returns true if every file was written.
+    bool WriteTo(const std::string& fileNamePrefix);
+
+private:
+    std::shared_ptr<SnapshotState> m_state;
+};
@@ -0,0 +1,339 @@
+#include "pagecodec.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iterator>
+#include <set>
+
+typedef std::chrono::steady_clock Clock;
+
+// Pages store counts in a single byte
+static const unsigned MAX_RECORDS_PER_PAGE = 255;
+
+static unsigned CommonPrefix(const char* a, unsigned aLength, const char* b, unsigned bLength)
+{
+    unsigned length = std::min(aLength, bLength);
+    unsigned i = 0;
+    while(i < length && a[i] == b[i]) i++;
+    return i;
+}
+
+static uint64_t ElapsedSince(const Clock::time_point& start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now() - start).count();
+}
+
+static bool ValueLess(const char* a, const char* b)
+{
+    return strncmp(a, b, sizeof(Record::value)) < 0;
+}
+
+// Size of a field prefix compressed against the previous one
+static unsigned CalcFieldSize(const char* previous, const char* field, unsigned fieldSize)
+{
+    unsigned length = FieldLength(field, fieldSize);
+    if(previous == nullptr) return 2 + length;
+    return 2 + length - CommonPrefix(previous, FieldLength(previous, fieldSize), field, length);
+}
+
+// Sorted distinct values of the first count records
+static void BuildDictionary(
+    const Record* records,
+    unsigned count,
+    std::vector<const char*>& outDictionary)
+{
+    outDictionary.clear();
+    for(unsigned i = 0; i < count; i++) outDictionary.push_back(records[i].value);
+
+    auto equal = [](const char* a, const char* b)
+    {
+        return strncmp(a, b, sizeof(Record::value)) == 0;
+    };
+
+    std::sort(outDictionary.begin(), outDictionary.end(), ValueLess);
+    outDictionary.erase(
+        std::unique(outDictionary.begin(), outDictionary.end(), equal),
+        outDictionary.end());
+}
+
+template <typename GetField>
+static unsigned EncodeFields(unsigned count, unsigned fieldSize, GetField getField, char* out)
+{
+    unsigned position = 0;
+    const char* previous = nullptr;
+    unsigned previousLength = 0;
+    for(unsigned i = 0; i < count; i++)
+    {
+        const char* field = getField(i);
+        unsigned length = FieldLength(field, fieldSize);
+        unsigned shared = previous ? CommonPrefix(previous, previousLength, field, length) : 0;
+
+        out[position++] = (char)shared;
+        out[position++] = (char)(length - shared);
+        memcpy(out + position, field + shared, length - shared);
+        position += length - shared;
+
+        previous = field;
+        previousLength = length;
+    }
+
+    return position;
+}
+
+// Decodes the next prefix compressed field over the previous one,
+// which is kept in field (fieldSize bytes, 0 padded).
+// Returns the position after the field.
+static unsigned DecodeField(const char* in, unsigned position, char* field, unsigned fieldSize)
+{
+    unsigned shared = (unsigned char)in[position];
+    unsigned length = (unsigned char)in[position + 1];
+    memcpy(field + shared, in + position + 2, length);
+    memset(field + shared + length, 0, fieldSize - shared - length);
+    return position + 2 + length;
+}
+
+PageCodec::PageCodec(unsigned pageSize)
+    : m_pageSize(pageSize),
+    m_pagesEncoded(0),
+    m_pagesDecoded(0),
+    m_recordBytes(0),
+    m_encodedBytes(0),
+    m_encodeNanoseconds(0),
+    m_decodeNanoseconds(0)
+{ }
+
+unsigned PageCodec::EncodePages(const std::vector<Record>& records, std::vector<char>& outPages)
+{
+    Clock::time_point start = Clock::now();
+
+    outPages.clear();
+    unsigned numberOfPages = 0;
+    unsigned first = 0;
+    uint64_t encodedBytes = 0;
+    do
+    {
+        unsigned count = CountRecordsThatFit(records.data() + first, records.size() - first);
+
+        outPages.resize(outPages.size() + m_pageSize, '\0');
+        char* page = &outPages[numberOfPages * m_pageSize];
+        encodedBytes += EncodePage(records.data() + first, count, page);
+
+        first += count;
+        numberOfPages++;
+    }
+    while(first < records.size());
+
+    m_pagesEncoded += numberOfPages;
+    m_recordBytes += records.size() * sizeof(Record);
+    m_encodedBytes += encodedBytes;
+    m_encodeNanoseconds += ElapsedSince(start);
+
+    return numberOfPages;
+}
+
+void PageCodec::DecodePage(const char* page, std::vector<Record>& outRecords)
+{
+    Clock::time_point start = Clock::now();
+
+    unsigned count = (unsigned char)page[0];
+    unsigned dictionarySize = (unsigned char)page[1];
+    unsigned position = 2;
+
+    size_t first = outRecords.size();
+    outRecords.resize(first + count);
+
+    char key[sizeof(Record::key)] = { 0 };
+    for(unsigned i = 0; i < count; i++)
+    {
+        position = DecodeField(page, position, key, sizeof(key));
+        memcpy(outRecords[first + i].key, key, sizeof(key));
+    }
+
+    const char* valueIndices = page + position;
+    position += count;
+
+    std::vector<char> dictionary(dictionarySize * sizeof(Record::value));
+    char value[sizeof(Record::value)] = { 0 };
+    for(unsigned i = 0; i < dictionarySize; i++)
+    {
+        position = DecodeField(page, position, value, sizeof(value));
+        memcpy(&dictionary[i * sizeof(value)], value, sizeof(value));
+    }
+
+    for(unsigned i = 0; i < count; i++)
+    {
+        unsigned index = (unsigned char)valueIndices[i];
+        memcpy(outRecords[first + i].value, &dictionary[index * sizeof(value)], sizeof(value));
+    }
+
+    m_pagesDecoded++;
+    m_decodeNanoseconds += ElapsedSince(start);
+}
+
+unsigned PageCodec::FindKey(
+    const char* page,
+    const char key[21],
+    bool firstOnly,
+    std::vector<std::string>& outValues,
+    bool& outPastKey)
+{
+    Clock::time_point start = Clock::now();
+
+    unsigned count = (unsigned char)page[0];
+    unsigned dictionarySize = (unsigned char)page[1];
+    unsigned position = 2;
+    outPastKey = false;
+
+    // Records with the key are consecutive, since keys are sorted
+    unsigned firstFound = 0;
+    unsigned numberFound = 0;
+
+    char currentKey[sizeof(Record::key)] = { 0 };
+    unsigned i = 0;
+    for(; i < count; i++)
+    {
+        position = DecodeField(page, position, currentKey, sizeof(currentKey));
+
+        int comparison = strncmp(currentKey, key, sizeof(currentKey));
+        if(comparison < 0) continue;
+        if(comparison > 0)
+        {
+            outPastKey = true;
+            break;
+        }
+
+        if(numberFound == 0) firstFound = i;
+        numberFound++;
+        if(firstOnly) break;
+    }
+
+    if(numberFound > 0)
+    {
+        // Skip the keys that weren't read, then decode the
+        // dictionary to get the values
+        for(i++; i < count; i++)
+        {
+            position += 2 + (unsigned char)page[position + 1];
+        }
+
+        const unsigned char* valueIndices = (const unsigned char*)page + position;
+        position += count;
+
+        unsigned lastIndex = 0;
+        for(unsigned j = firstFound; j < firstFound + numberFound; j++)
+        {
+            lastIndex = std::max(lastIndex, (unsigned)valueIndices[j]);
+        }
+
+        std::vector<std::string> dictionary;
+        char value[sizeof(Record::value)] = { 0 };
+        for(unsigned j = 0; j <= lastIndex && j < dictionarySize; j++)
+        {
+            position = DecodeField(page, position, value, sizeof(value));
+            dictionary.push_back(std::string(value, FieldLength(value, sizeof(value))));
+        }
+
+        for(unsigned j = firstFound; j < firstFound + numberFound; j++)
+        {
+            outValues.push_back(dictionary[valueIndices[j]]);
+        }
+    }
+
+    m_pagesDecoded++;
+    m_decodeNanoseconds += ElapsedSince(start);
+
+    return numberFound;
+}
+
+PageCodecStats PageCodec::GetStats() const
+{
+    PageCodecStats stats;
+    stats.pagesEncoded = m_pagesEncoded;
+    stats.pagesDecoded = m_pagesDecoded;
+    stats.recordBytes = m_recordBytes;
+    stats.encodedBytes = m_encodedBytes;
+    stats.encodeNanoseconds = m_encodeNanoseconds;
+    stats.decodeNanoseconds = m_decodeNanoseconds;
+    return stats;
+}
+
+void PageCodec::SortRecords(std::vector<Record>& records)
+{
+    std::sort(records.begin(), records.end(),
+        [](const Record& a, const Record& b)
+        {
+            int comparison = strncmp(a.key, b.key, sizeof(a.key));
+            if(comparison != 0) return comparison < 0;
+            return strncmp(a.value, b.value, sizeof(a.value)) < 0;
+        });
+}
+
+unsigned PageCodec::CountRecordsThatFit(const Record* records, unsigned remaining) const
+{
+    // Page header, and the first record, which always fits
+    if(remaining == 0) return 0;
+    unsigned size = 2 + 1 +
+        CalcFieldSize(nullptr, records[0].key, sizeof(Record::key)) +
+        CalcFieldSize(nullptr, records[0].value, sizeof(Record::value));
+
+    // The size is updated as each record is added. Keys are
+    // compressed against the previous record, and a new value
+    // changes only the size of the value that follows it in
+    // the dictionary.
+    std::set<const char*, bool (*)(const char*, const char*)> dictionary(ValueLess);
+    dictionary.insert(records[0].value);
+
+    unsigned count = 1;
+    for(; count < std::min(remaining, MAX_RECORDS_PER_PAGE); count++)
+    {
+        const Record& record = records[count];
+        unsigned newSize = size + 1 +
+            CalcFieldSize(records[count - 1].key, record.key, sizeof(Record::key));
+
+        auto next = dictionary.lower_bound(record.value);
+        bool isNewValue = next == dictionary.end() || ValueLess(record.value, *next);
+        if(isNewValue)
+        {
+            const char* previous = next == dictionary.begin() ? nullptr : *std::prev(next);
+            newSize += CalcFieldSize(previous, record.value, sizeof(Record::value));
+            if(next != dictionary.end())
+            {
+                newSize += CalcFieldSize(record.value, *next, sizeof(Record::value));
+                newSize -= CalcFieldSize(previous, *next, sizeof(Record::value));
+            }
+        }
+
+        if(newSize > m_pageSize) break;
+
+        size = newSize;
+        if(isNewValue) dictionary.insert(next, record.value);
+    }
+
+    return count;
+}
+
+unsigned PageCodec::EncodePage(const Record* records, unsigned count, char* page) const
+{
+    std::vector<const char*> dictionary;
+    BuildDictionary(records, count, dictionary);
+
+    page[0] = (char)count;
+    page[1] = (char)dictionary.size();
+    unsigned position = 2;
+
+    position += EncodeFields(count, sizeof(Record::key),
+        [records](unsigned i) { return records[i].key; }, page + position);
+
+    for(unsigned i = 0; i < count; i++)
+    {
+        auto found = std::lower_bound(
+            dictionary.begin(), dictionary.end(), records[i].value, ValueLess);
+        page[position++] = (char)(found - dictionary.begin());
+    }
+
+    position += EncodeFields(dictionary.size(), sizeof(Record::value),
+        [&dictionary](unsigned i) { return dictionary[i]; }, page + position);
+
+    return position;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "database.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct PageCodecStats
+{
+    uint64_t pagesEncoded;
+    uint64_t pagesDecoded;
+    // Size the encoded records would take as fixed width entries
+    uint64_t recordBytes;
+    // Size they took once encoded
+    uint64_t encodedBytes;
+    uint64_t encodeNanoseconds;
+    uint64_t decodeNanoseconds;
+
+    double GetCompressionRatio() const
+    {
+        return encodedBytes == 0 ? 1.0 : (double)recordBytes / encodedBytes;
+    }
+
+    double GetEncodeNanosecondsPerPage() const
+    {
+        return pagesEncoded == 0 ? 0.0 : (double)encodeNanoseconds / pagesEncoded;
+    }
+
+    double GetDecodeNanosecondsPerPage() const
+    {
+        return pagesDecoded == 0 ? 0.0 : (double)decodeNanoseconds / pagesDecoded;
+    }
+};
+
+// Encodes records into fixed size pages.
+//
+// Each page is self-contained. Records are sorted by key, and keys
+// are prefix compressed (each key stores only what differs from the
+// previous one). Values are replaced by an index into a dictionary
+// of the distinct values of the page, which is prefix compressed
+// the same way:
+//     u8 numberOfRecords
+//     u8 dictionarySize
+//     keys[numberOfRecords]          { u8 shared, u8 length, suffix }
+//     valueIndices[numberOfRecords]  u8
+//     dictionary[dictionarySize]     { u8 shared, u8 length, suffix }
+//
+// Keys can be searched without touching the values; the dictionary
+// is only decoded when a key is found. A page filled with 0's holds
+// no records.
+//
+// Encoding and decoding are thread-safe.
+class PageCodec
+{
+public:
+    explicit PageCodec(unsigned pageSize);
+
+    // Encodes records, which must be sorted by key, into as many
+    // pages as needed (at least one), stored into outPages.
+    // Consecutive pages hold increasing keys.
+    // Returns the number of pages.
+    unsigned EncodePages(const std::vector<Record>& records, std::vector<char>& outPages);
+
+    // Appends every record of a page to outRecords
+    void DecodePage(const char* page, std::vector<Record>& outRecords);
+
+    // Appends the values of the records with the key to outValues,
+    // stopping at the first one if firstOnly is true.
+    // outPastKey is set if the page has keys bigger than key,
+    // in which case the next pages can't hold it.
+    // Returns the number of values found.
+    unsigned FindKey(
+        const char* page,
+        const char key[21],
+        bool firstOnly,
+        std::vector<std::string>& outValues,
+        bool& outPastKey);
+
+    PageCodecStats GetStats() const;
+
+    // Sorts records the way EncodePages expects
+    static void SortRecords(std::vector<Record>& records);
+
+private:
+    // How many of the remaining records fit in a page, at least one
+    // if there are any
+    unsigned CountRecordsThatFit(const Record* records, unsigned remaining) const;
+
+    // Encodes the first count records into page.
+    // Returns the number of bytes used.
+    unsigned EncodePage(const Record* records, unsigned count, char* page) const;
+
+    unsigned m_pageSize;
+
+    std::atomic<uint64_t> m_pagesEncoded;
+    std::atomic<uint64_t> m_pagesDecoded;
+    std::atomic<uint64_t> m_recordBytes;
+    std::atomic<uint64_t> m_encodedBytes;
+    std::atomic<uint64_t> m_encodeNanoseconds;
+    std::atomic<uint64_t> m_decodeNanoseconds;
+};
@@ -0,0 +1,460 @@
+#include "snapshot.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char SNAPSHOT_MAGIC[8] = { 'S', 'K', 'Y', 'S', 'N', 'A', 'P', '2' };
+
+// Runs of entries never cross a page of this size
+static const unsigned SNAPSHOT_PAGE_SIZE = 4096;
+
+// Average amount of keys per bucket of the perfect hash
+static const unsigned KEYS_PER_BUCKET = 4;
+
+// Pilot values tried for a bucket before giving up on a seed.
+// Pilots are stored in 16 bits.
+static const uint32_t MAX_PILOT = 1 << 16;
+
+// Seeds tried before giving up on building the perfect hash
+static const unsigned MAX_SEEDS = 16;
+
+// Finalizer of MurmurHash3
+static uint64_t Mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+static uint64_t HashKey(const char key[21], uint64_t seed)
+{
+    size_t length = FieldLength(key, Database::KEY_SIZE);
+
+    uint64_t words[3] = { 0, 0, 0 };
+    memcpy(words, key, length);
+
+    uint64_t hash = Mix64(seed ^ length);
+    for(unsigned i = 0; i < 3; i++) hash = Mix64(hash ^ words[i]);
+    return hash;
+}
+
+static unsigned CalcBucket(uint64_t keyHash, unsigned numberOfBuckets)
+{
+    return (unsigned)((keyHash >> 32) % numberOfBuckets);
+}
+
+static unsigned CalcPosition(uint64_t keyHash, uint32_t pilot, uint64_t seed, unsigned tableSize)
+{
+    return (unsigned)((keyHash ^ Mix64(pilot ^ seed)) % tableSize);
+}
+
+// Searches a pilot for every bucket, so each key gets its own slot.
+// Stores the slot of each key into outSlots.
+// Returns false if some bucket couldn't be placed with this seed.
+static bool BuildPerfectHash(
+    const std::vector<uint64_t>& keyHashes,
+    const SnapshotHeader& header,
+    std::vector<uint16_t>& outPilots,
+    std::vector<unsigned>& outSlots)
+{
+    unsigned numberOfKeys = keyHashes.size();
+
+    // Group keys by bucket
+    std::vector< std::pair<unsigned, unsigned> > keysByBucket(numberOfKeys);
+    for(unsigned i = 0; i < numberOfKeys; i++)
+    {
+        keysByBucket[i] = std::make_pair(
+            CalcBucket(keyHashes[i], header.numberOfBuckets), i);
+    }
+    std::sort(keysByBucket.begin(), keysByBucket.end());
+
+    // (size, first key) of each bucket. The biggest buckets
+    // are placed first, while there are many free slots.
+    std::vector< std::pair<unsigned, unsigned> > buckets;
+    for(unsigned i = 0; i < numberOfKeys;)
+    {
+        unsigned j = i;
+        while(j < numberOfKeys && keysByBucket[j].first == keysByBucket[i].first) j++;
+        buckets.push_back(std::make_pair(j - i, i));
+        i = j;
+    }
+    std::sort(buckets.begin(), buckets.end(),
+        [](const std::pair<unsigned, unsigned>& a, const std::pair<unsigned, unsigned>& b)
+        {
+            return a.first > b.first;
+        });
+
+    outPilots.assign(header.numberOfBuckets, 0);
+    outSlots.assign(numberOfKeys, 0);
+    std::vector<bool> taken(header.tableSize, false);
+    std::vector<unsigned> positions;
+
+    for(unsigned b = 0; b < buckets.size(); b++)
+    {
+        unsigned size = buckets[b].first;
+        unsigned first = buckets[b].second;
+
+        bool placed = false;
+        for(uint32_t pilot = 0; pilot < MAX_PILOT && !placed; pilot++)
+        {
+            positions.clear();
+            placed = true;
+            for(unsigned i = first; i < first + size && placed; i++)
+            {
+                unsigned position = CalcPosition(
+                    keyHashes[keysByBucket[i].second], pilot, header.seed, header.tableSize);
+
+                if(taken[position] ||
+                   std::find(positions.begin(), positions.end(), position) != positions.end())
+                {
+                    placed = false;
+                }
+                positions.push_back(position);
+            }
+
+            if(!placed) continue;
+
+            outPilots[keysByBucket[first].first] = (uint16_t)pilot;
+            for(unsigned i = 0; i < size; i++)
+            {
+                taken[positions[i]] = true;
+                outSlots[keysByBucket[first + i].second] = positions[i];
+            }
+        }
+
+        if(!placed) return false;
+    }
+
+    return true;
+}
+
+// Calls callback with the entries of each key (a run),
+// sorted by key within each index of the database
+static void ForEachRun(
+    Database& db,
+    const std::function<void(const Record* run, unsigned count)>& callback)
+{
+    db.ForEachIndex([&callback](std::vector<Record>& records)
+    {
+        std::sort(records.begin(), records.end(),
+            [](const Record& a, const Record& b)
+            {
+                return strncmp(a.key, b.key, sizeof(a.key)) < 0;
+            });
+
+        for(unsigned i = 0; i < records.size();)
+        {
+            unsigned j = i + 1;
+            while(j < records.size() &&
+                  strncmp(records[j].key, records[i].key, sizeof(records[i].key)) == 0)
+            {
+                j++;
+            }
+
+            callback(&records[i], j - i);
+            i = j;
+        }
+    });
+}
+
+// Slots placed at the beginning of a block of pages
+struct SnapshotBlock
+{
+    unsigned firstPage;
+    unsigned firstSlot;
+    unsigned numberOfSlots;
+};
+
+// Places the runs, in slot order, into blocks that fill a page each,
+// or a single run that doesn't fit a page by itself.
+// Stores the first slot of the block of each page into outPageFirstSlots.
+static void LayOutBlocks(
+    const std::vector<unsigned>& countAtSlot,
+    std::vector<SnapshotBlock>& outBlocks,
+    std::vector<uint32_t>& outPageFirstSlots)
+{
+    unsigned numberOfSlots = countAtSlot.size();
+    unsigned page = 0;
+    for(unsigned slot = 0; slot < numberOfSlots;)
+    {
+        SnapshotBlock block = { page, slot, 0 };
+
+        // Number of slots, then the end of each run
+        uint64_t size = sizeof(uint32_t);
+        while(slot < numberOfSlots)
+        {
+            uint64_t slotSize = sizeof(uint32_t) + (uint64_t)countAtSlot[slot] * sizeof(Entry);
+            if(block.numberOfSlots > 0 && size + slotSize > SNAPSHOT_PAGE_SIZE) break;
+
+            size += slotSize;
+            block.numberOfSlots++;
+            slot++;
+        }
+
+        unsigned numberOfPages = (size + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE;
+        outBlocks.push_back(block);
+        outPageFirstSlots.insert(outPageFirstSlots.end(), numberOfPages, block.firstSlot);
+        page += numberOfPages;
+    }
+}
+
+bool Snapshot::Export(Database& db, const std::string& fileName)
+{
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+
+    // Only the hash and the number of entries of each key are kept,
+    // in the order ForEachRun visits the keys
+    std::vector<uint64_t> keyHashes;
+    std::vector<unsigned> keyCounts;
+    std::vector<uint16_t> pilots;
+    std::vector<unsigned> slots;
+
+    bool built = false;
+    for(unsigned attempt = 0; attempt < MAX_SEEDS && !built; attempt++)
+    {
+        header.seed = Mix64(attempt + 1);
+        header.numberOfEntries = 0;
+        keyHashes.clear();
+        keyCounts.clear();
+        ForEachRun(db, [&](const Record* run, unsigned count)
+        {
+            keyHashes.push_back(HashKey(run->key, header.seed));
+            keyCounts.push_back(count);
+            header.numberOfEntries += count;
+        });
+
+        header.numberOfKeys = keyHashes.size();
+        header.tableSize = header.numberOfKeys == 0 ?
+            0 : header.numberOfKeys + header.numberOfKeys / 64 + 1;
+        // An even number of 16 bit pilots keeps the tables after them aligned
+        header.numberOfBuckets = header.numberOfKeys / KEYS_PER_BUCKET / 2 * 2 + 2;
+
+        built = header.numberOfKeys == 0 ||
+            BuildPerfectHash(keyHashes, header, pilots, slots);
+    }
+    if(!built) return false;
+
+    unsigned numberOfKeys = header.numberOfKeys;
+    pilots.resize(header.numberOfBuckets, 0);
+    std::vector<uint64_t>().swap(keyHashes);
+
+    // Slots past numberOfKeys are moved to the free slots below it
+    std::vector<uint32_t> remap(header.tableSize - numberOfKeys, 0);
+    std::vector<bool> taken(numberOfKeys, false);
+    for(unsigned i = 0; i < numberOfKeys; i++)
+    {
+        if(slots[i] < numberOfKeys) taken[slots[i]] = true;
+    }
+
+    unsigned freeSlot = 0;
+    for(unsigned i = 0; i < numberOfKeys; i++)
+    {
+        if(slots[i] < numberOfKeys) continue;
+
+        while(taken[freeSlot]) freeSlot++;
+        taken[freeSlot] = true;
+        remap[slots[i] - numberOfKeys] = freeSlot;
+        slots[i] = freeSlot;
+    }
+
+    std::vector<unsigned> countAtSlot(numberOfKeys);
+    for(unsigned i = 0; i < numberOfKeys; i++) countAtSlot[slots[i]] = keyCounts[i];
+
+    std::vector<SnapshotBlock> blocks;
+    std::vector<uint32_t> pageFirstSlots;
+    LayOutBlocks(countAtSlot, blocks, pageFirstSlots);
+    header.numberOfPages = pageFirstSlots.size();
+
+    size_t tablesSize = sizeof(SnapshotHeader) +
+        pilots.size() * sizeof(uint16_t) +
+        remap.size() * sizeof(uint32_t) +
+        pageFirstSlots.size() * sizeof(uint32_t);
+    uint64_t pagesOffset =
+        (tablesSize + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE;
+
+    std::string temporaryFileName = fileName + ".tmp";
+    std::ofstream file(temporaryFileName, std::ofstream::out | std::ofstream::binary);
+    if(!file.is_open()) return false;
+
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)pilots.data(), pilots.size() * sizeof(uint16_t));
+    file.write((const char*)remap.data(), remap.size() * sizeof(uint32_t));
+    file.write((const char*)pageFirstSlots.data(), pageFirstSlots.size() * sizeof(uint32_t));
+
+    // Write the directory of each block, and find where the
+    // entries of each slot go
+    std::vector<uint64_t> positions(numberOfKeys);
+    std::vector<uint32_t> directory;
+    for(unsigned b = 0; b < blocks.size(); b++)
+    {
+        const SnapshotBlock& block = blocks[b];
+        uint64_t blockOffset = pagesOffset + (uint64_t)block.firstPage * SNAPSHOT_PAGE_SIZE;
+        uint64_t entriesOffset = blockOffset + sizeof(uint32_t) * (1 + block.numberOfSlots);
+
+        directory.assign(1, block.numberOfSlots);
+        uint32_t runEnd = 0;
+        for(unsigned slot = block.firstSlot; slot < block.firstSlot + block.numberOfSlots; slot++)
+        {
+            positions[slot] = entriesOffset + (uint64_t)runEnd * sizeof(Entry);
+            runEnd += countAtSlot[slot];
+            directory.push_back(runEnd);
+        }
+
+        file.seekp(blockOffset);
+        file.write((const char*)directory.data(), directory.size() * sizeof(uint32_t));
+    }
+
+    // Blocks may end before their last page does
+    uint64_t fileSize = pagesOffset + (uint64_t)header.numberOfPages * SNAPSHOT_PAGE_SIZE;
+    if(fileSize > (uint64_t)file.tellp())
+    {
+        file.seekp(fileSize - 1);
+        file.write("", 1);
+    }
+
+    // The database is read again, in the same order, and each
+    // run is written where its slot goes
+    unsigned key = 0;
+    bool unchanged = true;
+    ForEachRun(db, [&](const Record* run, unsigned count)
+    {
+        if(!unchanged) return;
+        if(key >= numberOfKeys || keyCounts[key] != count)
+        {
+            unchanged = false;
+            return;
+        }
+
+        file.seekp(positions[slots[key]]);
+        file.write((const char*)run, count * sizeof(Record));
+        key++;
+    });
+
+    file.close();
+    if(!unchanged || key != numberOfKeys || !file.good() ||
+       std::rename(temporaryFileName.c_str(), fileName.c_str()) != 0)
+    {
+        std::remove(temporaryFileName.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+Snapshot::Snapshot(const std::string& fileName)
+    : m_data(nullptr),
+    m_size(0),
+    m_pilots(nullptr),
+    m_remap(nullptr),
+    m_pageFirstSlots(nullptr),
+    m_pages(nullptr)
+{
+    memset(&m_header, 0, sizeof(m_header));
+
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if(fd < 0) return;
+
+    struct stat fileStat;
+    if(fstat(fd, &fileStat) != 0 || (size_t)fileStat.st_size < sizeof(SnapshotHeader))
+    {
+        close(fd);
+        return;
+    }
+
+    m_size = fileStat.st_size;
+    void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the file is closed
+    close(fd);
+    if(data == MAP_FAILED) return;
+
+    m_data = (const char*)data;
+    memcpy(&m_header, m_data, sizeof(m_header));
+
+    size_t tablesSize = sizeof(SnapshotHeader) +
+        sizeof(uint16_t) * (size_t)m_header.numberOfBuckets +
+        sizeof(uint32_t) * (
+            (size_t)(m_header.tableSize - m_header.numberOfKeys) +
+            m_header.numberOfPages);
+    size_t pagesOffset =
+        (tablesSize + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE * SNAPSHOT_PAGE_SIZE;
+
+    if(memcmp(m_header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+       m_header.tableSize < m_header.numberOfKeys ||
+       (m_header.numberOfKeys > 0 && m_header.numberOfPages == 0) ||
+       m_size < tablesSize ||
+       (m_header.numberOfPages > 0 &&
+        m_size < pagesOffset + (size_t)m_header.numberOfPages * SNAPSHOT_PAGE_SIZE))
+    {
+        munmap((void*)m_data, m_size);
+        m_data = nullptr;
+        return;
+    }
+
+    m_pilots = (const uint16_t*)(m_data + sizeof(SnapshotHeader));
+    m_remap = (const uint32_t*)(m_pilots + m_header.numberOfBuckets);
+    m_pageFirstSlots = m_remap + (m_header.tableSize - m_header.numberOfKeys);
+    m_pages = m_data + pagesOffset;
+
+    // Lookups are random, so there is no point in reading ahead
+    madvise((void*)m_data, m_size, MADV_RANDOM);
+}
+
+Snapshot::~Snapshot()
+{
+    if(m_data != nullptr) munmap((void*)m_data, m_size);
+}
+
+int Snapshot::GetEntry(const char key[21], std::vector<std::string>& outValues)
+{
+    if(m_data == nullptr || m_header.numberOfKeys == 0) return 0;
+
+    unsigned slot = CalcSlot(key);
+
+    // The last page whose block starts at or before the slot,
+    // then the first page of that block
+    const uint32_t* pagesEnd = m_pageFirstSlots + m_header.numberOfPages;
+    const uint32_t* page = std::upper_bound(m_pageFirstSlots, pagesEnd, slot) - 1;
+    page = std::lower_bound(m_pageFirstSlots, page, *page);
+
+    const char* block = m_pages + (size_t)(page - m_pageFirstSlots) * SNAPSHOT_PAGE_SIZE;
+    const uint32_t* directory = (const uint32_t*)block;
+    const Entry* entries = (const Entry*)(directory + 1 + directory[0]);
+
+    unsigned slotInBlock = slot - *page;
+    uint32_t first = slotInBlock == 0 ? 0 : directory[slotInBlock];
+    uint32_t last = directory[slotInBlock + 1];
+
+    // Keys that are not in the snapshot still map to some slot,
+    // so the key stored there must be checked
+    if(strncmp(entries[first].key, key, Database::KEY_SIZE) != 0) return 0;
+
+    for(uint32_t i = first; i < last; i++)
+    {
+        const char* value = entries[i].value;
+        outValues.push_back(std::string(value, FieldLength(value, Database::VALUE_SIZE)));
+    }
+
+    return 1;
+}
+
+unsigned Snapshot::CalcSlot(const char key[21]) const
+{
+    uint64_t keyHash = HashKey(key, m_header.seed);
+    uint16_t pilot = m_pilots[CalcBucket(keyHash, m_header.numberOfBuckets)];
+    unsigned position = CalcPosition(keyHash, pilot, m_header.seed, m_header.tableSize);
+
+    if(position >= m_header.numberOfKeys) return m_remap[position - m_header.numberOfKeys];
+    return position;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "database.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#pragma pack(push, 1)
+struct SnapshotHeader
+{
+    char magic[8];
+    unsigned numberOfKeys;
+    unsigned numberOfEntries;
+    unsigned tableSize;
+    unsigned numberOfBuckets;
+    unsigned numberOfPages;
+    uint64_t seed;
+};
+#pragma pack(pop)
+
+// Immutable, read-only copy of a database.
+//
+// Keys are mapped to slots by a minimal perfect hash: each key
+// falls into a bucket, and each bucket has a pilot value chosen
+// so its keys land on free slots. The table has slightly more
+// slots than keys; keys on the extra slots are remapped to the
+// free ones below numberOfKeys.
+//
+// File layout:
+//     SnapshotHeader
+//     pilots[numberOfBuckets]            u16
+//     remap[tableSize - numberOfKeys]    u32
+//     pageFirstSlots[numberOfPages]      u32
+//     (padding up to a page boundary)
+//     pages[numberOfPages]
+//
+// Entries with the same key are stored together (a run), in slot
+// order. Runs never cross a page: a block holds as many runs as fit
+// in a page, after a directory with the end of each run:
+//     u32 numberOfSlots
+//     u32 runEnds[numberOfSlots]     (in entries, from the first one)
+//     entries
+// Only a key with more entries than fit in a page gets a block of
+// several pages, on its own. pageFirstSlots holds the first slot of
+// the block each page belongs to.
+//
+// The tables above take less than a byte per key, so they stay in
+// memory; a lookup then reads a single page.
+class Snapshot : public EntrySource
+{
+public:
+    // Writes every entry of db into a snapshot file.
+    // The database is read twice, one index at a time, so only a
+    // few numbers per key are kept in memory. The file is written
+    // under a temporary name, and renamed once complete, so it is
+    // never seen half written.
+    // Returns true if the file was written.
+    // Returns false otherwise.
+    static bool Export(Database& db, const std::string& fileName);
+
+    // Maps the snapshot file into memory. The mapping is read-only,
+    // so it can be shared by any number of processes.
+    explicit Snapshot(const std::string& fileName);
+    ~Snapshot();
+
+    Snapshot(const Snapshot&) = delete;
+    Snapshot& operator=(const Snapshot&) = delete;
+
+    bool IsOpen() const { return m_data != nullptr; }
+
+    int GetEntry(const char key[21], std::vector<std::string>& outValues) override;
+
+    unsigned GetNumberOfKeys() const { return m_header.numberOfKeys; }
+    unsigned GetNumberOfEntries() const { return m_header.numberOfEntries; }
+
+private:
+    // Returns the slot of a key. If the key is not in the
+    // snapshot, returns an arbitrary slot.
+    unsigned CalcSlot(const char key[21]) const;
+
+    const char* m_data;
+    size_t m_size;
+
+    SnapshotHeader m_header;
+    const uint16_t* m_pilots;
+    const uint32_t* m_remap;
+    const uint32_t* m_pageFirstSlots;
+    const char* m_pages;
+};
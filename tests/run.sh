@@ -0,0 +1,37 @@
+#!/bin/sh
+# Runs every tests/in.N that has an expected tests/out.N, in numeric
+# order, and compares the output of bin/main with tests/out.N.
+# Each input starts in an empty directory (with tests/in.N.dat as its
+# data file, if present), except in.3 to in.6, which continue from
+# the data files left by the input before them.
+
+cd "$(dirname "$0")"
+TESTS=$(pwd)
+MAIN=$TESTS/../bin/main
+directory=
+failed=0
+
+for n in $(ls in.* | sed -n 's/^in\.\([0-9]*\)$/\1/p' | sort -n)
+do
+    [ -f out.$n ] || continue
+
+    case $n in
+        3|4|5|6) ;;
+        *)
+            [ -n "$directory" ] && rm -rf "$directory"
+            directory=$(mktemp -d)
+            [ -f in.$n.dat ] && cp in.$n.dat "$directory/data.dat"
+            ;;
+    esac
+
+    if (cd "$directory" && "$MAIN" < "$TESTS/in.$n") | diff -q out.$n - > /dev/null
+    then
+        echo "in.$n: ok"
+    else
+        echo "in.$n: FAILED"
+        failed=1
+    fi
+done
+
+[ -n "$directory" ] && rm -rf "$directory"
+exit $failed